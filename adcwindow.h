@@ -0,0 +1,71 @@
+/*
+ * ADC windows
+ *
+ * Every sample of an analog channel is folded into a running minimum,
+ * maximum, sum and sum of squares, so that scratch can be told about
+ * what happened between reports, such as a spike in motor current,
+ * rather than only the value at the moment of the report.  Folding a
+ * sample is a few arithmetic operations with no branches, so sampling
+ * at the board's full rate costs almost nothing.
+ */
+#ifndef ADCWINDOW_H
+#define ADCWINDOW_H
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+// ANALOG_MESSAGE carries 4 bits of channel
+#define ADC_WINDOW_CHANNELS 16
+
+// results of a window, in this order
+#define ADC_MIN 0
+#define ADC_MAX 1
+#define ADC_MEAN 2
+#define ADC_RMS 3
+#define ADC_RESULTS 4
+
+typedef struct
+{
+    uint32_t min;
+    uint32_t max;
+    uint32_t count;
+    uint64_t sum;
+    uint64_t sumsq;
+} adc_window;
+
+inline void adc_window_reset(adc_window &w)
+{
+    w.min = UINT32_MAX;
+    w.max = 0;
+    w.count = 0;
+    w.sum = 0;
+    w.sumsq = 0;
+}
+
+inline void adc_window_fold(adc_window &w, uint32_t value)
+{
+    w.min = std::min(w.min, value);
+    w.max = std::max(w.max, value);
+    w.sum += value;
+    w.sumsq += (uint64_t)value * value;
+    ++w.count;
+}
+
+// fill in results and start a new window
+// returns false, leaving results alone, if there were no samples
+inline bool adc_window_take(adc_window &w, uint32_t results[ADC_RESULTS])
+{
+    if (w.count == 0)
+    {
+        return false;
+    }
+    results[ADC_MIN] = w.min;
+    results[ADC_MAX] = w.max;
+    results[ADC_MEAN] = (w.sum + (w.count / 2)) / w.count;
+    results[ADC_RMS] = (uint32_t)(sqrt((double)w.sumsq / w.count) + 0.5);
+    adc_window_reset(w);
+    return true;
+}
+
+#endif
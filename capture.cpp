@@ -0,0 +1,69 @@
+/*
+ * Sensor capture file, see capture.h
+ */
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+#include "firmlink.h"
+
+capture_header *capture_hdr = nullptr;
+capture_record *capture_records = nullptr;
+size_t capture_size = 0;
+
+bool capture_open(const std::string &path, uint32_t records)
+{
+    capture_close();
+
+    if (records == 0)
+    {
+        records = CAPTURE_DEFAULT_RECORDS;
+    }
+    capture_size = sizeof(capture_header) + ((size_t)records * sizeof(capture_record));
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open capture file " << path << ", " << strerror(errno) << std::endl;
+        return false;
+    }
+    // allocate the blocks now rather than faulting them in while capturing
+    int err = posix_fallocate(fd, 0, capture_size);
+    if (err != 0)
+    {
+        std::cerr << "Failed to allocate capture file " << path << ", " << strerror(err) << std::endl;
+        close(fd);
+        return false;
+    }
+    void *p = mmap(nullptr, capture_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        std::cerr << "Failed to map capture file " << path << ", " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    capture_hdr = (capture_header *)p;
+    capture_records = (capture_record *)(capture_hdr + 1);
+    capture_hdr->magic = CAPTURE_MAGIC;
+    capture_hdr->version = CAPTURE_VERSION;
+    capture_hdr->record_size = sizeof(capture_record);
+    capture_hdr->capacity = records;
+    capture_hdr->start_ns = monotonic_ns();
+    capture_hdr->head = 0;
+    return true;
+}
+
+void capture_close()
+{
+    if (capture_hdr != nullptr)
+    {
+        munmap(capture_hdr, capture_size);
+        capture_hdr = nullptr;
+        capture_records = nullptr;
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * Sensor capture file
+ *
+ * Every sample the board sends is appended to a preallocated, memory
+ * mapped file used as a ring buffer, so recording costs a few stores and
+ * no syscalls.  The file is a header followed by capacity fixed size
+ * records, the record for sample n lives in slot n % capacity.
+ *
+ * Read back with capturedump.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <string>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC 0x50414353 // "SCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_DEFAULT_RECORDS (1024*1024)
+
+// record kinds, match SAMPLE_xxx in firmlink.h
+#define CAPTURE_ANALOG 0 // index is analog channel
+#define CAPTURE_DIGITAL 1 // index is port, value is 8 pin states
+#define CAPTURE_ENCODER 2 // index is encoder number, value is int32_t position
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity; // number of record slots
+    uint64_t start_ns; // monotonic time capture started
+    uint64_t head; // number of records ever written
+    uint8_t pad[32];
+} capture_header;
+
+typedef struct
+{
+    uint64_t t_ns; // monotonic time sample arrived
+    uint8_t kind;
+    uint8_t index;
+    uint16_t reserved;
+    uint32_t value;
+} capture_record;
+
+// open, size and map the capture file, returns false on failure
+bool capture_open(const std::string &path, uint32_t records);
+void capture_close();
+
+extern capture_header *capture_hdr;
+extern capture_record *capture_records;
+
+// append a sample, must only be called if capture_open() succeeded
+inline void capture_write(uint64_t t_ns, uint8_t kind, uint8_t index, uint32_t value)
+{
+    uint64_t head = capture_hdr->head;
+    capture_record &r(capture_records[head % capture_hdr->capacity]);
+    r.t_ns = t_ns;
+    r.kind = kind;
+    r.index = index;
+    r.reserved = 0;
+    r.value = value;
+    // publish the record after it is complete
+    __atomic_store_n(&capture_hdr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
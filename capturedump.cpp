@@ -0,0 +1,88 @@
+/*
+ * Export a sensor capture file written by scratchdaemon -C to CSV
+ *
+ * Output columns are time (seconds since capture started), kind
+ * (adc/port/encoder), index (analog channel/port/encoder number) and
+ * value.  Oldest records first.
+ */
+#include <iostream>
+#include <iomanip>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+
+void usage(const char * progname, const char * msg = nullptr)
+{
+    if (msg != nullptr) std::cerr << msg << std::endl;
+    std::cerr << "Usage: "<<progname<<" captureFile" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+    if (argc != 2)
+    {
+        usage(argv[0]);
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) < 0))
+    {
+        std::cerr << "Failed to open " << argv[1] << ", " << strerror(errno) << std::endl;
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(capture_header))
+    {
+        usage(argv[0], "Not a capture file");
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        std::cerr << "Failed to map " << argv[1] << ", " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    const capture_header *hdr = (const capture_header *)p;
+    const capture_record *records = (const capture_record *)(hdr + 1);
+    if ((hdr->magic != CAPTURE_MAGIC) ||
+        (hdr->version != CAPTURE_VERSION) ||
+        (hdr->record_size != sizeof(capture_record)) ||
+        (sizeof(capture_header) + ((size_t)hdr->capacity * sizeof(capture_record)) > (size_t)st.st_size))
+    {
+        usage(argv[0], "Not a capture file or unsupported version");
+    }
+
+    // the capture may still be running, take a copy of head
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > hdr->capacity) ? (head - hdr->capacity) : 0;
+
+    std::cout << "time,kind,index,value" << std::endl;
+    std::cout << std::fixed << std::setprecision(6);
+    for (uint64_t n = first; n < head; ++n)
+    {
+        const capture_record &r(records[n % hdr->capacity]);
+        std::cout << ((r.t_ns - hdr->start_ns) / 1e9) << ",";
+        switch (r.kind)
+        {
+            case CAPTURE_ANALOG:
+                std::cout << "adc," << (int)r.index << "," << r.value << std::endl;
+                break;
+            case CAPTURE_ENCODER:
+                std::cout << "encoder," << (int)r.index << "," << (int32_t)r.value << std::endl;
+                break;
+            default:
+                std::cout << "port," << (int)r.index << "," << r.value << std::endl;
+                break;
+        }
+    }
+
+    munmap(p, st.st_size);
+    return 0;
+}
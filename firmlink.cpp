@@ -0,0 +1,488 @@
+/*
+ * Link to the Firmata board, see firmlink.h
+ */
+#include <string.h>
+#include <algorithm>
+
+#include "firmlink.h"
+#include "firmata.h"
+
+// allow this much sending ahead of the rate, in ms
+#define LINK_BURST_MS 20
+// longest sysex from the board passed on while tapped
+#define LINK_MAX_SYSEX 4096
+
+FirmLink::FirmLink(firmata::FirmIO *io) :
+    m_io(io),
+    m_batch(false),
+    m_batch_ns(0),
+    m_lane(LINK_NORMAL),
+    m_group(0),
+    m_last_group(0),
+    m_rate(0),
+    m_tokens(0),
+    m_refill_ns(0),
+    m_cmd(0),
+    m_need(0),
+    m_have(0),
+    m_sysex(false),
+    m_serial_port(-1),
+    m_serial_odd(false),
+    m_encoder_have(-1),
+    m_tap(false)
+{
+    memset(stats, 0, sizeof(stats));
+    memset(serial_ns, 0, sizeof(serial_ns));
+    serial_ports = 0;
+    memset(m_ports, 0, sizeof(m_ports));
+    memset(m_shared, 0, sizeof(m_shared));
+    for (int lane = 0; lane < LINK_LANES; ++lane)
+    {
+        m_queue[lane].head = 0;
+        m_queue[lane].tail = 0;
+    }
+}
+
+FirmLink::~FirmLink()
+{
+    delete m_io;
+}
+
+void FirmLink::open()
+{
+    m_io->open();
+}
+
+bool FirmLink::isOpen()
+{
+    return m_io->isOpen();
+}
+
+void FirmLink::close()
+{
+    m_io->close();
+}
+
+size_t FirmLink::available()
+{
+    // firmata waits for replies by polling, keep the queue moving
+    pump();
+    return m_io->available();
+}
+
+std::vector<uint8_t> FirmLink::read(size_t size)
+{
+    std::vector<uint8_t> bytes(m_io->read(size));
+    uint64_t now = monotonic_ns();
+    std::vector<uint8_t>::const_iterator i = bytes.begin();
+    while (i != bytes.end())
+    {
+        decode(*i, now);
+        ++i;
+    }
+    return bytes;
+}
+
+// each write from the firmata library is one queue entry, the key says
+// which pin or port value it sets so that newer writes can replace it
+size_t FirmLink::write(std::vector<uint8_t> bytes)
+{
+    size_t size = bytes.size();
+    if (size == 0)
+    {
+        return 0;
+    }
+    uint8_t *b = bytes.data();
+    uint16_t key = 0;
+    switch (b[0] & 0xf0)
+    {
+        case FIRMATA_ANALOG_MESSAGE:
+            if (size == 3)
+            {
+                key = LINK_KEY_ANALOG | (b[0] & 0x0f);
+            }
+            break;
+        case FIRMATA_DIGITAL_MESSAGE:
+            // carries the whole port so a later one replaces it
+            if (size == 3)
+            {
+                // the daemon's port state does not know about pins other
+                // programs set, they stay as last written
+                uint8_t port = b[0] & 0x0f;
+                uint8_t value = b[1] | (b[2] << 7);
+                value = (value & ~m_shared[port]) | (m_ports[port] & m_shared[port]);
+                b[1] = value & 0x7f;
+                b[2] = value >> 7;
+                key = LINK_KEY_PORT | port;
+                m_ports[port] = value;
+            }
+            break;
+        default:
+            // extended analog
+            if ((b[0] == FIRMATA_START_SYSEX) && (size > 3) &&
+                (b[1] == 0x6f) && (b[size - 1] == FIRMATA_END_SYSEX) &&
+                (memchr(b + 1, FIRMATA_END_SYSEX, size - 2) == nullptr))
+            {
+                key = LINK_KEY_ANALOG | b[2];
+            }
+            break;
+    }
+
+    // one clock read stands for every write in a batch
+    uint64_t now = m_batch ? m_batch_ns : monotonic_ns();
+    link_msg *m = nullptr;
+    if ((m_lane == LINK_PRIORITY) && (key != 0))
+    {
+        // anything normal still waiting to set the same thing is stale
+        link_queue &q(m_queue[LINK_NORMAL]);
+        size_t keep = q.head;
+        for (size_t i = q.head; i < q.tail; ++i)
+        {
+            if (q.msgs[i].key == key)
+            {
+                ++stats[LINK_NORMAL].superseded;
+                continue;
+            }
+            if (keep != i)
+            {
+                std::swap(q.msgs[keep], q.msgs[i]);
+            }
+            ++keep;
+        }
+        q.tail = keep;
+    }
+    else if ((m_lane == LINK_NORMAL) && (key & LINK_KEY_ANALOG))
+    {
+        // overwrite a value still waiting for this pin, but not across
+        // anything else which might change what the value means, such
+        // as a pin mode, nor into or across another group, whose
+        // direction pins must go out with its own values
+        link_queue &q(m_queue[LINK_NORMAL]);
+        size_t i = q.tail;
+        while ((i > q.head) && (q.msgs[i - 1].key != 0) && (q.msgs[i - 1].group == m_group))
+        {
+            --i;
+            if (q.msgs[i].key == key)
+            {
+                ++stats[LINK_NORMAL].conflated;
+                m = &q.msgs[i];
+                break;
+            }
+        }
+    }
+    if (m == nullptr)
+    {
+        link_queue &q(m_queue[m_lane]);
+        if ((q.tail == q.msgs.size()) && (q.head > 0) && (q.head >= q.msgs.size() / 2))
+        {
+            // the lane never quite drained, at least half of it has been
+            // sent so move what is left down rather than growing it
+            for (size_t i = q.head; i < q.tail; ++i)
+            {
+                std::swap(q.msgs[i - q.head], q.msgs[i]);
+            }
+            q.tail -= q.head;
+            q.head = 0;
+        }
+        if (q.tail == q.msgs.size())
+        {
+            q.msgs.resize(q.tail + 1);
+        }
+        m = &q.msgs[q.tail++];
+        m->key = key;
+        m->group = m_group;
+    }
+    m->t_ns = now;
+    m->bytes.assign((const char *)b, size);
+
+    if (!m_batch)
+    {
+        send(now);
+    }
+    return size;
+}
+
+size_t FirmLink::writePort(uint8_t port, uint8_t value, uint8_t mask)
+{
+    port &= 0x0f;
+    m_shared[port] = mask;
+    m_ports[port] = (value & mask) | (m_ports[port] & ~mask);
+    std::vector<uint8_t> bytes(3);
+    bytes[0] = FIRMATA_DIGITAL_MESSAGE | port;
+    bytes[1] = m_ports[port] & 0x7f;
+    bytes[2] = m_ports[port] >> 7;
+    return write(bytes);
+}
+
+void FirmLink::batch(bool on)
+{
+    m_batch = on;
+    if (on)
+    {
+        m_batch_ns = monotonic_ns();
+    }
+    else
+    {
+        pump();
+    }
+}
+
+void FirmLink::discard()
+{
+    m_batch = false;
+    m_lane = LINK_NORMAL;
+    m_group = 0;
+    for (int lane = 0; lane < LINK_LANES; ++lane)
+    {
+        m_queue[lane].head = 0;
+        m_queue[lane].tail = 0;
+    }
+}
+
+void FirmLink::priority(bool on)
+{
+    m_lane = on ? LINK_PRIORITY : LINK_NORMAL;
+}
+
+void FirmLink::group(bool on)
+{
+    if (!on)
+    {
+        m_group = 0;
+        return;
+    }
+    // 0 means no group
+    if (++m_last_group == 0)
+    {
+        ++m_last_group;
+    }
+    m_group = m_last_group;
+}
+
+void FirmLink::tap(bool on)
+{
+    m_tap = on;
+    m_msg.clear();
+}
+
+void FirmLink::setRate(uint32_t rate)
+{
+    m_rate = rate;
+    m_tokens = 0;
+    m_refill_ns = monotonic_ns();
+}
+
+bool FirmLink::queued() const
+{
+    return (m_queue[LINK_PRIORITY].head != m_queue[LINK_PRIORITY].tail) ||
+           (m_queue[LINK_NORMAL].head != m_queue[LINK_NORMAL].tail);
+}
+
+bool FirmLink::pump()
+{
+    if (m_batch || !queued())
+    {
+        return queued();
+    }
+    return send(monotonic_ns());
+}
+
+// everything the rate allows goes to the transport in one write, the
+// priority lane first
+bool FirmLink::send(uint64_t now)
+{
+    if (m_rate > 0)
+    {
+        // only whole bytes are added, the rest of the time carries over
+        uint64_t add = ((now - m_refill_ns) * m_rate) / 1000000000ull;
+        m_tokens += add;
+        m_refill_ns += (add * 1000000000ull) / m_rate;
+        int64_t burst = std::max<int64_t>(((int64_t)m_rate * LINK_BURST_MS) / 1000, 64);
+        if (m_tokens > burst)
+        {
+            m_tokens = burst;
+            m_refill_ns = now;
+        }
+    }
+
+    m_out.clear();
+    for (int lane = LINK_PRIORITY; lane >= LINK_NORMAL; --lane)
+    {
+        link_queue &q(m_queue[lane]);
+        uint32_t sending = 0;
+        while ((q.head < q.tail) && ((m_rate == 0) || (m_tokens > 0) ||
+                                     ((sending != 0) && (q.msgs[q.head].group == sending))))
+        {
+            link_msg &m(q.msgs[q.head++]);
+            sending = m.group;
+            m_out.insert(m_out.end(), m.bytes.begin(), m.bytes.end());
+            m_tokens -= m.bytes.size();
+            uint64_t wait = now - m.t_ns;
+            ++stats[lane].sent;
+            stats[lane].wait_ns += wait;
+            stats[lane].max_wait_ns = std::max(stats[lane].max_wait_ns, wait);
+        }
+        if (q.head == q.tail)
+        {
+            q.head = 0;
+            q.tail = 0;
+        }
+    }
+    if (!m_out.empty())
+    {
+        m_io->write(m_out);
+    }
+    return queued();
+}
+
+// track message boundaries in the stream from the board and queue any
+// pin values seen
+void FirmLink::decode(uint8_t c, uint64_t now)
+{
+    if (c & 0x80)
+    {
+        if (m_tap)
+        {
+            if (m_sysex && (c == FIRMATA_END_SYSEX) && (!m_msg.empty()))
+            {
+                m_msg.push_back(c);
+                replies.append(m_msg);
+                m_msg.clear();
+            }
+            else if (c != FIRMATA_END_SYSEX)
+            {
+                m_msg.assign(1, c);
+            }
+        }
+        // command byte, always starts a new message
+        m_sysex = false;
+        m_serial_port = -1;
+        m_encoder_have = -1;
+        m_cmd = c;
+        m_have = 0;
+        switch (c & 0xf0)
+        {
+            case FIRMATA_DIGITAL_MESSAGE:
+            case FIRMATA_ANALOG_MESSAGE:
+                m_need = 2;
+                break;
+            default:
+                if (c == FIRMATA_START_SYSEX)
+                {
+                    m_sysex = true;
+                }
+                else if (c == FIRMATA_REPORT_VERSION)
+                {
+                    m_need = 2;
+                    break;
+                }
+                m_need = 0;
+                break;
+        }
+        if (m_tap && (!m_sysex) && (m_need == 0) && (!m_msg.empty()))
+        {
+            replies.append(m_msg);
+            m_msg.clear();
+        }
+        return;
+    }
+
+    if (m_sysex)
+    {
+        if (m_tap && (!m_msg.empty()))
+        {
+            m_msg.push_back(c);
+            if (m_msg.size() > LINK_MAX_SYSEX)
+            {
+                m_msg.clear();
+            }
+        }
+        if (m_serial_port >= 0)
+        {
+            // serial reply data, each byte as two 7 bit halves
+            if (m_serial_odd)
+            {
+                uint8_t port = m_serial_port;
+                if (serial[port].empty())
+                {
+                    serial_ns[port] = now;
+                    serial_ports |= (1 << port);
+                }
+                serial[port].push_back(m_data[0] | (c << 7));
+            }
+            else
+            {
+                m_data[0] = c;
+            }
+            m_serial_odd = !m_serial_odd;
+        }
+        else if (m_encoder_have >= 0)
+        {
+            m_encoder[m_encoder_have++] = c;
+            if (m_encoder_have == sizeof(m_encoder))
+            {
+                int32_t pos = m_encoder[1] | (m_encoder[2] << 7) |
+                              (m_encoder[3] << 14) | (m_encoder[4] << 21);
+                link_sample s;
+                s.t_ns = now;
+                s.kind = SAMPLE_ENCODER;
+                s.index = m_encoder[0] & 0x3f;
+                s.value = (m_encoder[0] & 0x40) ? -pos : pos;
+                samples.push_back(s);
+                m_encoder_have = 0;
+            }
+        }
+        else if (m_have < 2)
+        {
+            // encoder positions (0x61), or Firmata Serial (0x60) reply
+            // (0x40) for port
+            m_data[m_have++] = c;
+            if ((m_have == 1) && (c == 0x61))
+            {
+                m_encoder_have = 0;
+            }
+            else if ((m_have == 2) && (m_data[0] == 0x60) && ((m_data[1] & 0xf0) == 0x40))
+            {
+                m_serial_port = m_data[1] & 0x0f;
+                m_serial_odd = false;
+            }
+        }
+        return;
+    }
+    if (m_have >= m_need)
+    {
+        // stray data byte
+        return;
+    }
+
+    m_data[m_have++] = c;
+    if (m_tap)
+    {
+        m_msg.push_back(c);
+    }
+    if (m_have < m_need)
+    {
+        return;
+    }
+    if (m_tap)
+    {
+        replies.append(m_msg);
+        m_msg.clear();
+    }
+
+    link_sample s;
+    s.t_ns = now;
+    s.index = m_cmd & 0x0f;
+    s.value = m_data[0] | (m_data[1] << 7);
+    switch (m_cmd & 0xf0)
+    {
+        case FIRMATA_ANALOG_MESSAGE:
+            s.kind = SAMPLE_ANALOG;
+            samples.push_back(s);
+            break;
+        case FIRMATA_DIGITAL_MESSAGE:
+            s.kind = SAMPLE_DIGITAL;
+            samples.push_back(s);
+            break;
+    }
+}
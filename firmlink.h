@@ -0,0 +1,192 @@
+/*
+ * Link to the Firmata board
+ *
+ * Wraps the serial or Bluetooth FirmIO handed to the firmata library so
+ * that the daemon can see every message the board sends, not just the
+ * latest values the library keeps.  Samples are decoded as the library
+ * reads them and queued with the time they arrived, the daemon then
+ * collects them after each parse().
+ *
+ * Writes to the board are queued and sent no faster than the link rate
+ * so that the queue builds here rather than in the transport.  There are
+ * two lanes, anything in the priority lane is sent before normal
+ * traffic, and replaces any normal write still queued which sets the
+ * same pin or port.
+ *
+ * Analog writes (PWM and servo positions) in the normal lane are last
+ * value wins: while one is still queued for a pin, a new value for that
+ * pin overwrites it in place, so a slider dragged faster than the link
+ * can carry does not leave a growing backlog of positions.
+ *
+ * Writes made while grouping are sent together, once the first of them
+ * goes to the transport the rest follow in the same write whatever the
+ * rate allows, so that e.g. both wheels of a robot change speed at once.
+ * A value is only overwritten by one from the same group, or another
+ * ungrouped one, so a group never goes out with another's values.
+ *
+ * While tapped, every complete message from the board is also kept as
+ * it arrived so that it can be passed on to other programs sharing the
+ * board.
+ *
+ * Bytes the board's serial ports received (Firmata Serial replies) are
+ * collected per port so that each can be passed on in one piece.
+ * Encoder positions, which the board sends all together, are queued as
+ * one sample per encoder.
+ */
+#ifndef FIRMLINK_H
+#define FIRMLINK_H
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <time.h>
+
+#include "firmio.h"
+
+// monotonic time in ns, does not need a syscall on Linux
+inline uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+#define SAMPLE_ANALOG 0 // index is analog channel
+#define SAMPLE_DIGITAL 1 // index is port, value is 8 pin states
+#define SAMPLE_ENCODER 2 // index is encoder number, value is int32_t position
+typedef struct
+{
+    uint64_t t_ns;
+    uint8_t kind;
+    uint8_t index;
+    uint32_t value;
+} link_sample;
+
+#define LINK_NORMAL 0
+#define LINK_PRIORITY 1
+#define LINK_LANES 2
+
+// key of a queued write, which pin or port value it sets
+#define LINK_KEY_ANALOG 0x100
+#define LINK_KEY_PORT 0x200
+
+// board serial ports, as SERIAL_xxx in serialpty.h
+#define LINK_SERIAL_PORTS 16
+
+// time spent queued, per lane
+typedef struct
+{
+    uint64_t sent; // messages
+    uint64_t superseded; // messages replaced before they were sent
+    uint64_t conflated; // analog values overwritten by a newer value
+    uint64_t wait_ns; // total
+    uint64_t max_wait_ns;
+} link_lane_stats;
+
+class FirmLink : public firmata::FirmIO
+{
+public:
+    // takes ownership of io
+    FirmLink(firmata::FirmIO *io);
+    virtual ~FirmLink();
+
+    virtual void open();
+    virtual bool isOpen();
+    virtual void close();
+    virtual size_t available();
+    virtual std::vector<uint8_t> read(size_t size = 1);
+    virtual size_t write(std::vector<uint8_t> bytes);
+
+    // while batching, writes are held and then sent as one when the
+    // batch ends
+    void batch(bool on);
+    // drop everything queued and end any batch
+    void discard();
+    // lane used by following writes
+    void priority(bool on);
+    // following writes are sent together, only while batching
+    void group(bool on);
+    // bytes per second the link can carry, 0 for no limit
+    void setRate(uint32_t rate);
+
+    // send whatever the rate allows, returns true if anything is left
+    bool pump();
+    bool queued() const;
+
+    // keep messages from the board in replies
+    void tap(bool on);
+    // last value written to a digital port
+    uint8_t portValue(uint8_t port) const { return m_ports[port & 0x0f]; }
+    // a digital port write from another program sharing the board, only
+    // the bits in mask are its, and any port write after it, from the
+    // firmata library too, leaves those bits as it set them
+    size_t writePort(uint8_t port, uint8_t value, uint8_t mask);
+    // the pin is no longer another program's to set
+    void claimPin(uint8_t pin) { m_shared[(pin >> 3) & 0x0f] &= ~(1 << (pin & 0x07)); }
+
+    // samples decoded since last cleared
+    std::vector<link_sample> samples;
+    // messages from the board since last cleared, while tapped
+    std::string replies;
+    // bytes from each serial port since last cleared, and when the
+    // first of them arrived
+    std::string serial[LINK_SERIAL_PORTS];
+    uint64_t serial_ns[LINK_SERIAL_PORTS];
+    uint16_t serial_ports; // bit per port with bytes
+    link_lane_stats stats[LINK_LANES];
+
+private:
+    typedef struct
+    {
+        uint64_t t_ns; // when queued
+        uint16_t key; // pin or port set, 0 if none or several
+        uint32_t group; // sent with the rest of its group, 0 if none
+        std::string bytes;
+    } link_msg;
+
+    // waiting in a lane, entries from head to tail are queued and the
+    // rest are kept to be reused; what is queued is moved down to the
+    // start once the sent entries before it are half the lane, so a lane
+    // that never drains stays at about twice its backlog
+    typedef struct
+    {
+        std::vector<link_msg> msgs;
+        size_t head;
+        size_t tail;
+    } link_queue;
+
+    bool send(uint64_t now);
+    void decode(uint8_t c, uint64_t now);
+
+    firmata::FirmIO *m_io;
+    bool m_batch;
+    uint64_t m_batch_ns; // when the batch began, stands for every write in it
+    uint8_t m_lane;
+    uint32_t m_group;
+    uint32_t m_last_group;
+    link_queue m_queue[LINK_LANES];
+    std::vector<uint8_t> m_out;
+
+    // token bucket for the link rate
+    uint32_t m_rate;
+    int64_t m_tokens;
+    uint64_t m_refill_ns;
+
+    // decoder state
+    uint8_t m_cmd;
+    uint8_t m_need;
+    uint8_t m_have;
+    uint8_t m_data[2];
+    bool m_sysex;
+    int8_t m_serial_port; // of the serial reply being received, or -1
+    bool m_serial_odd; // the low 7 bits of a byte are in m_data[0]
+    int8_t m_encoder_have; // bytes of the encoder in m_encoder, or -1
+    uint8_t m_encoder[5]; // direction and number, then 4x7 bits of position
+    bool m_tap;
+    std::string m_msg; // message being received, while tapped
+
+    uint8_t m_ports[16];
+    uint8_t m_shared[16]; // bits of each port set by other programs
+};
+
+#endif
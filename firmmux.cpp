@@ -0,0 +1,297 @@
+/*
+ * Raw Firmata multiplexer, see firmmux.h
+ */
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "firmmux.h"
+
+#define MUX_START_SYSEX 0xf0
+#define MUX_END_SYSEX 0xf7
+#define MUX_STRING_DATA 0x71
+
+// data bytes following a command byte from a client, sysex excepted
+static uint8_t data_bytes(uint8_t cmd)
+{
+    switch (cmd & 0xf0)
+    {
+        case 0xc0: // report analog pin
+        case 0xd0: // report digital port
+            return 1;
+        case 0xf0:
+            // set pin mode and set digital pin value, everything else
+            // from a client (version query, reset) stands alone
+            return ((cmd == 0xf4) || (cmd == 0xf5)) ? 2 : 0;
+        default:
+            return 2;
+    }
+}
+
+FirmMux::FirmMux(msgfunc handler) :
+    m_handler(handler),
+    m_listen_fd(-1)
+{
+}
+
+FirmMux::~FirmMux()
+{
+    std::vector<mux_client>::iterator i = m_clients.begin();
+    while (i != m_clients.end())
+    {
+        close(i->fd);
+        ++i;
+    }
+    if (m_listen_fd >= 0)
+    {
+        close(m_listen_fd);
+        unlink(m_path.c_str());
+    }
+}
+
+bool FirmMux::listen(const std::string &path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0)
+    {
+        return false;
+    }
+    // left behind if the daemon was killed
+    unlink(path.c_str());
+    if ((bind(m_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (::listen(m_listen_fd, 4) < 0))
+    {
+        int e = errno;
+        close(m_listen_fd);
+        m_listen_fd = -1;
+        errno = e;
+        return false;
+    }
+    m_path = path;
+    return true;
+}
+
+int FirmMux::fill_fds(fd_set &read_set, fd_set &write_set, int fd_max)
+{
+    if (m_listen_fd >= 0)
+    {
+        FD_SET(m_listen_fd, &read_set);
+        fd_max = std::max(fd_max, m_listen_fd);
+    }
+    std::vector<mux_client>::const_iterator i = m_clients.begin();
+    while (i != m_clients.end())
+    {
+        FD_SET(i->fd, &read_set);
+        if (!i->out.empty())
+        {
+            FD_SET(i->fd, &write_set);
+        }
+        fd_max = std::max(fd_max, i->fd);
+        ++i;
+    }
+    return fd_max;
+}
+
+void FirmMux::handle(const fd_set &read_set, const fd_set &write_set)
+{
+    // clients can be added by accept and by nothing else, so go through
+    // the existing ones by index first
+    size_t i = 0;
+    while (i < m_clients.size())
+    {
+        bool ok = true;
+        if (FD_ISSET(m_clients[i].fd, &read_set))
+        {
+            ok = read_client(m_clients[i]);
+        }
+        if (ok && (!m_clients[i].out.empty()) && FD_ISSET(m_clients[i].fd, &write_set))
+        {
+            ok = flush(m_clients[i]);
+        }
+        if (ok && m_clients[i].closing && m_clients[i].out.empty())
+        {
+            ok = false;
+        }
+        if (!ok)
+        {
+            close(m_clients[i].fd);
+            m_clients.erase(m_clients.begin() + i);
+            continue;
+        }
+        ++i;
+    }
+
+    if ((m_listen_fd >= 0) && FD_ISSET(m_listen_fd, &read_set))
+    {
+        accept_client();
+    }
+}
+
+// clients which fail are only marked here and removed by handle()
+void FirmMux::send(const std::string &bytes)
+{
+    std::vector<mux_client>::iterator i = m_clients.begin();
+    while (i != m_clients.end())
+    {
+        if (!i->closing)
+        {
+            i->out.append(bytes);
+            if (!flush(*i))
+            {
+                i->out.clear();
+                i->closing = true;
+            }
+        }
+        ++i;
+    }
+}
+
+size_t FirmMux::clients() const
+{
+    return m_clients.size();
+}
+
+void FirmMux::accept_client()
+{
+    int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    mux_client c;
+    c.fd = fd;
+    c.closing = false;
+    c.need = 0;
+    c.sysex = false;
+    m_clients.push_back(c);
+}
+
+// returns false if the client should be dropped
+bool FirmMux::read_client(mux_client &c)
+{
+    unsigned char buf[4096];
+    ssize_t n = read(c.fd, buf, sizeof(buf));
+    if (n == 0)
+    {
+        return false;
+    }
+    if (n < 0)
+    {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR));
+    }
+    if (c.closing)
+    {
+        return true;
+    }
+    for (ssize_t i = 0; i < n; ++i)
+    {
+        if (!parse(c, buf[i]))
+        {
+            return false;
+        }
+    }
+    return flush(c);
+}
+
+// collect one byte, handing over each complete message
+// returns false if the client should be dropped
+bool FirmMux::parse(mux_client &c, uint8_t b)
+{
+    if (b & 0x80)
+    {
+        if (c.sysex && (b == MUX_END_SYSEX))
+        {
+            c.msg.push_back(b);
+            c.sysex = false;
+        }
+        else
+        {
+            // command byte, always starts a new message
+            c.msg.assign(1, b);
+            c.sysex = (b == MUX_START_SYSEX);
+            c.need = data_bytes(b);
+            if (c.sysex || (c.need > 0))
+            {
+                return true;
+            }
+        }
+    }
+    else
+    {
+        if (c.msg.empty())
+        {
+            // stray data byte
+            return true;
+        }
+        c.msg.push_back(b);
+        if (c.sysex)
+        {
+            return (c.msg.size() < MUX_MAX_SYSEX);
+        }
+        if (c.msg.size() <= c.need)
+        {
+            return true;
+        }
+    }
+
+    const char *why = m_handler(c.msg);
+    if (why != nullptr)
+    {
+        refuse(c, why);
+    }
+    c.msg.clear();
+    return true;
+}
+
+// tell the client why, as a Firmata string
+void FirmMux::refuse(mux_client &c, const char *why)
+{
+    c.out.push_back((char)MUX_START_SYSEX);
+    c.out.push_back((char)MUX_STRING_DATA);
+    while (*why != '\0')
+    {
+        c.out.push_back(*why & 0x7f);
+        c.out.push_back((*why >> 7) & 0x01);
+        ++why;
+    }
+    c.out.push_back((char)MUX_END_SYSEX);
+}
+
+// send as much as the socket will take
+bool FirmMux::flush(mux_client &c)
+{
+    while (!c.out.empty())
+    {
+        // a client going away must not raise SIGPIPE
+        ssize_t n = ::send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        c.out.erase(0, n);
+    }
+    // a client that stops reading is dropped rather than queued for
+    return (c.out.size() <= MUX_MAX_PENDING);
+}
@@ -0,0 +1,74 @@
+/*
+ * Raw Firmata multiplexer
+ *
+ * Lets other programs, such as a calibration tool or a Python script
+ * using pyfirmata, share the board with scratch.  Clients connect to a
+ * Unix socket and speak Firmata as if it were the serial port.  Each
+ * complete message a client sends is handed to the daemon, which may
+ * refuse it if it would change a pin scratch is using, and everything
+ * the board sends is passed on to every client.
+ *
+ * Nothing blocks, the owner adds the mux's fds to its select() sets
+ * with fill_fds() and passes the results back to handle().
+ */
+#ifndef FIRMMUX_H
+#define FIRMMUX_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <sys/select.h>
+
+// most a client may have waiting to be sent before it is dropped
+#define MUX_MAX_PENDING (256*1024)
+// longest sysex accepted from a client
+#define MUX_MAX_SYSEX 1024
+
+class FirmMux
+{
+public:
+    // given one complete Firmata message, which it may change, returns
+    // nullptr if accepted or why not
+    typedef std::function<const char *(std::string &)> msgfunc;
+
+    FirmMux(msgfunc handler);
+    ~FirmMux();
+
+    // listen on a Unix socket at path, replacing any old one, false if
+    // that fails
+    bool listen(const std::string &path);
+
+    // add the fds that need watching, returns the new fd_max
+    int fill_fds(fd_set &read_set, fd_set &write_set, int fd_max);
+    // accept clients, read their messages and send what is pending
+    void handle(const fd_set &read_set, const fd_set &write_set);
+
+    // queue bytes from the board for every client
+    void send(const std::string &bytes);
+
+    size_t clients() const;
+
+private:
+    typedef struct
+    {
+        int fd;
+        bool closing; // drop once out is sent
+        std::string msg; // message being received
+        uint8_t need; // data bytes msg needs, unless sysex
+        bool sysex;
+        std::string out;
+    } mux_client;
+
+    void accept_client();
+    bool read_client(mux_client &c);
+    bool parse(mux_client &c, uint8_t b);
+    void refuse(mux_client &c, const char *why);
+    bool flush(mux_client &c);
+
+    msgfunc m_handler;
+    int m_listen_fd;
+    std::string m_path;
+    std::vector<mux_client> m_clients;
+};
+
+#endif
@@ -0,0 +1,442 @@
+/*
+ * Simulated Firmata board, see firmsim.h
+ */
+#include <string.h>
+
+#include "firmsim.h"
+#include "firmlink.h"
+#include "firmata.h"
+
+#define SIM_PWM_PINS ((1u<<3)|(1u<<5)|(1u<<6)|(1u<<9)|(1u<<10)|(1u<<11))
+#define SIM_FIRST_ANALOG (FIRMSIM_PINS - FIRMSIM_ANALOG)
+
+FirmSim::FirmSim() :
+    bytesWritten(0),
+    m_open(false),
+    m_freeRunning(true),
+    m_interval(19),
+    m_nextSample(0)
+{
+    m_serialReading = 0;
+    m_encoders = 0;
+    m_encoderAuto = false;
+    memset(m_encoderPos, 0, sizeof(m_encoderPos));
+    memset(written, 0, sizeof(written));
+    memset(modes, MODE_OUTPUT, sizeof(modes));
+    memset(m_analog, 0, sizeof(m_analog));
+    memset(m_inputs, 0, sizeof(m_inputs));
+    memset(m_reportAnalog, 0, sizeof(m_reportAnalog));
+    memset(m_reportPort, 0, sizeof(m_reportPort));
+    for (int pin = SIM_FIRST_ANALOG; pin < FIRMSIM_PINS; ++pin)
+    {
+        modes[pin] = MODE_ANALOG;
+    }
+}
+
+FirmSim::~FirmSim()
+{
+}
+
+void FirmSim::open()
+{
+    m_open = true;
+}
+
+bool FirmSim::isOpen()
+{
+    return m_open;
+}
+
+void FirmSim::close()
+{
+    m_open = false;
+}
+
+size_t FirmSim::available()
+{
+    tick();
+    return m_out.size();
+}
+
+std::vector<uint8_t> FirmSim::read(size_t size)
+{
+    tick();
+    if (size > m_out.size())
+    {
+        size = m_out.size();
+    }
+    std::vector<uint8_t> bytes(m_out.begin(), m_out.begin() + size);
+    m_out.erase(m_out.begin(), m_out.begin() + size);
+    return bytes;
+}
+
+size_t FirmSim::write(std::vector<uint8_t> bytes)
+{
+    bytesWritten += bytes.size();
+    std::vector<uint8_t>::const_iterator i = bytes.begin();
+    while (i != bytes.end())
+    {
+        uint8_t c = *i++;
+        if ((c & 0x80) && (c != FIRMATA_END_SYSEX))
+        {
+            // new command, drop any incomplete one
+            m_in.clear();
+        }
+        else if (m_in.empty())
+        {
+            // stray data byte
+            continue;
+        }
+        m_in.push_back(c);
+
+        size_t need;
+        switch (m_in[0] & 0xf0)
+        {
+            case FIRMATA_DIGITAL_MESSAGE:
+            case FIRMATA_ANALOG_MESSAGE:
+                need = 3;
+                break;
+            case FIRMATA_REPORT_ANALOG:
+            case FIRMATA_REPORT_DIGITAL:
+                need = 2;
+                break;
+            default:
+                switch (m_in[0])
+                {
+                    case FIRMATA_START_SYSEX:
+                        need = (c == FIRMATA_END_SYSEX) ? m_in.size() : (m_in.size() + 1);
+                        break;
+                    case FIRMATA_SET_PIN_MODE:
+                    case FIRMATA_SET_DIGITAL_PIN_VALUE:
+                        need = 3;
+                        break;
+                    default:
+                        need = 1;
+                        break;
+                }
+                break;
+        }
+        if (m_in.size() >= need)
+        {
+            handle(m_in);
+            m_in.clear();
+        }
+    }
+    return bytes.size();
+}
+
+void FirmSim::setAnalog(uint8_t channel, uint32_t value)
+{
+    if (channel < FIRMSIM_ANALOG)
+    {
+        m_analog[channel] = value & 0x3fff;
+        sendAnalog(channel);
+    }
+}
+
+void FirmSim::setDigital(uint8_t pin, bool value)
+{
+    if (pin < FIRMSIM_PINS)
+    {
+        if (value)
+        {
+            m_inputs[pin / 8] |= (1 << (pin % 8));
+        }
+        else
+        {
+            m_inputs[pin / 8] &= ~(1 << (pin % 8));
+        }
+        sendPort(pin / 8);
+    }
+}
+
+void FirmSim::setFreeRunning(bool on)
+{
+    m_freeRunning = on;
+}
+
+void FirmSim::sendAnalog(uint8_t channel)
+{
+    if (m_reportAnalog[channel])
+    {
+        m_out.push_back(FIRMATA_ANALOG_MESSAGE | channel);
+        m_out.push_back(m_analog[channel] & 0x7f);
+        m_out.push_back((m_analog[channel] >> 7) & 0x7f);
+    }
+}
+
+void FirmSim::sendPort(uint8_t port)
+{
+    if (m_reportPort[port])
+    {
+        m_out.push_back(FIRMATA_DIGITAL_MESSAGE | port);
+        m_out.push_back(m_inputs[port] & 0x7f);
+        m_out.push_back((m_inputs[port] >> 7) & 0x7f);
+    }
+}
+
+// every attached encoder in one message
+void FirmSim::sendEncoders()
+{
+    m_out.push_back(FIRMATA_START_SYSEX);
+    m_out.push_back(0x61);
+    for (int e = 0; e < FIRMSIM_ENCODERS; ++e)
+    {
+        if (m_encoders & (1 << e))
+        {
+            int32_t pos = m_encoderPos[e];
+            uint32_t mag = (pos < 0) ? -pos : pos;
+            m_out.push_back(((pos < 0) ? 0x40 : 0) | e);
+            m_out.push_back(mag & 0x7f);
+            m_out.push_back((mag >> 7) & 0x7f);
+            m_out.push_back((mag >> 14) & 0x7f);
+            m_out.push_back((mag >> 21) & 0x7f);
+        }
+    }
+    m_out.push_back(FIRMATA_END_SYSEX);
+}
+
+// send the periodic samples if they are due
+void FirmSim::tick()
+{
+    if (!m_freeRunning)
+    {
+        return;
+    }
+    uint64_t now = monotonic_ns();
+    if (now < m_nextSample)
+    {
+        return;
+    }
+    m_nextSample = now + (m_interval * 1000000ull);
+    for (uint8_t channel = 0; channel < FIRMSIM_ANALOG; ++channel)
+    {
+        // something that changes so there is a visible difference
+        m_analog[channel] = (m_analog[channel] + 7 + channel) % 1024;
+        sendAnalog(channel);
+    }
+    for (uint8_t port = 0; port < ((FIRMSIM_PINS + 7) / 8); ++port)
+    {
+        sendPort(port);
+    }
+    for (int e = 0; e < FIRMSIM_ENCODERS; ++e)
+    {
+        m_encoderPos[e] += (e & 1) ? -(e + 1) : (e + 1);
+    }
+    if (m_encoderAuto && (m_encoders != 0))
+    {
+        sendEncoders();
+    }
+}
+
+void FirmSim::handle(const std::vector<uint8_t> &msg)
+{
+    uint8_t cmd = msg[0];
+    switch (cmd & 0xf0)
+    {
+        case FIRMATA_DIGITAL_MESSAGE:
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                int pin = ((cmd & 0x0f) * 8) + bit;
+                if ((pin < FIRMSIM_PINS) && (modes[pin] == MODE_OUTPUT))
+                {
+                    written[pin] = ((msg[1] | (msg[2] << 7)) >> bit) & 1;
+                }
+            }
+            return;
+        case FIRMATA_ANALOG_MESSAGE:
+            if ((cmd & 0x0f) < FIRMSIM_PINS)
+            {
+                written[cmd & 0x0f] = msg[1] | (msg[2] << 7);
+            }
+            return;
+        case FIRMATA_REPORT_ANALOG:
+            m_reportAnalog[cmd & 0x0f] = (msg[1] != 0);
+            sendAnalog(cmd & 0x0f);
+            return;
+        case FIRMATA_REPORT_DIGITAL:
+            m_reportPort[cmd & 0x0f] = (msg[1] != 0);
+            sendPort(cmd & 0x0f);
+            return;
+    }
+    switch (cmd)
+    {
+        case FIRMATA_SET_PIN_MODE:
+            if (msg[1] < FIRMSIM_PINS)
+            {
+                modes[msg[1]] = msg[2];
+            }
+            break;
+        case FIRMATA_SET_DIGITAL_PIN_VALUE:
+            if (msg[1] < FIRMSIM_PINS)
+            {
+                written[msg[1]] = msg[2];
+            }
+            break;
+        case FIRMATA_REPORT_VERSION:
+            m_out.push_back(FIRMATA_REPORT_VERSION);
+            m_out.push_back(2);
+            m_out.push_back(5);
+            break;
+        case FIRMATA_SYSTEM_RESET:
+            memset(m_reportAnalog, 0, sizeof(m_reportAnalog));
+            memset(m_reportPort, 0, sizeof(m_reportPort));
+            m_serialReading = 0;
+            m_encoders = 0;
+            m_encoderAuto = false;
+            break;
+        case FIRMATA_START_SYSEX:
+            handleSysex(msg);
+            break;
+    }
+}
+
+void FirmSim::handleSysex(const std::vector<uint8_t> &msg)
+{
+    if (msg.size() < 3)
+    {
+        return;
+    }
+    switch (msg[1])
+    {
+        case 0x79: // firmware name and version
+        {
+            const char *name = "FirmSim";
+            m_out.push_back(FIRMATA_START_SYSEX);
+            m_out.push_back(0x79);
+            m_out.push_back(2);
+            m_out.push_back(5);
+            while (*name)
+            {
+                m_out.push_back(*name & 0x7f);
+                m_out.push_back(0);
+                ++name;
+            }
+            m_out.push_back(FIRMATA_END_SYSEX);
+            break;
+        }
+        case 0x6b: // capability query
+            m_out.push_back(FIRMATA_START_SYSEX);
+            m_out.push_back(0x6c);
+            for (int pin = 0; pin < FIRMSIM_PINS; ++pin)
+            {
+                m_out.push_back(MODE_INPUT); m_out.push_back(1);
+                m_out.push_back(MODE_OUTPUT); m_out.push_back(1);
+                m_out.push_back(MODE_PULLUP); m_out.push_back(1);
+                if (SIM_PWM_PINS & (1u << pin))
+                {
+                    m_out.push_back(MODE_PWM); m_out.push_back(8);
+                }
+                m_out.push_back(MODE_SERVO); m_out.push_back(14);
+                if (pin >= SIM_FIRST_ANALOG)
+                {
+                    m_out.push_back(MODE_ANALOG); m_out.push_back(10);
+                }
+                m_out.push_back(0x7f);
+            }
+            m_out.push_back(FIRMATA_END_SYSEX);
+            break;
+        case 0x69: // analog mapping query
+            m_out.push_back(FIRMATA_START_SYSEX);
+            m_out.push_back(0x6a);
+            for (int pin = 0; pin < FIRMSIM_PINS; ++pin)
+            {
+                m_out.push_back((pin >= SIM_FIRST_ANALOG) ? (pin - SIM_FIRST_ANALOG) : 0x7f);
+            }
+            m_out.push_back(FIRMATA_END_SYSEX);
+            break;
+        case 0x6d: // pin state query
+            if (msg[2] < FIRMSIM_PINS)
+            {
+                m_out.push_back(FIRMATA_START_SYSEX);
+                m_out.push_back(0x6e);
+                m_out.push_back(msg[2]);
+                m_out.push_back(modes[msg[2]]);
+                m_out.push_back(written[msg[2]] & 0x7f);
+                m_out.push_back(FIRMATA_END_SYSEX);
+            }
+            break;
+        case 0x7a: // sampling interval
+            if (msg.size() >= 5)
+            {
+                m_interval = msg[2] | (msg[3] << 7);
+                if (m_interval == 0)
+                {
+                    m_interval = 1;
+                }
+            }
+            break;
+        case 0x60: // serial
+            switch (msg[2] & 0xf0)
+            {
+                case 0x30: // read, 0 for continuously
+                    if ((msg.size() >= 5) && (msg[3] == 0))
+                    {
+                        m_serialReading |= (1 << (msg[2] & 0x0f));
+                    }
+                    else
+                    {
+                        m_serialReading &= ~(1 << (msg[2] & 0x0f));
+                    }
+                    break;
+                case 0x20: // write, loop it back as a reply
+                    if (m_serialReading & (1 << (msg[2] & 0x0f)))
+                    {
+                        m_out.push_back(FIRMATA_START_SYSEX);
+                        m_out.push_back(0x60);
+                        m_out.push_back(0x40 | (msg[2] & 0x0f));
+                        m_out.insert(m_out.end(), msg.begin() + 3, msg.end() - 1);
+                        m_out.push_back(FIRMATA_END_SYSEX);
+                    }
+                    break;
+                case 0x50: // close
+                    m_serialReading &= ~(1 << (msg[2] & 0x0f));
+                    break;
+            }
+            break;
+        case 0x61: // encoder
+            switch (msg[2])
+            {
+                case 0x00: // attach
+                    if ((msg.size() >= 7) && (msg[3] < FIRMSIM_ENCODERS))
+                    {
+                        m_encoders |= (1 << msg[3]);
+                        m_encoderPos[msg[3]] = 0;
+                    }
+                    break;
+                case 0x02: // report positions
+                    sendEncoders();
+                    break;
+                case 0x03: // reset position
+                    if ((msg.size() >= 5) && (msg[3] < FIRMSIM_ENCODERS))
+                    {
+                        m_encoderPos[msg[3]] = 0;
+                    }
+                    break;
+                case 0x04: // automatic reporting
+                    if (msg.size() >= 5)
+                    {
+                        m_encoderAuto = (msg[3] != 0);
+                    }
+                    break;
+                case 0x05: // detach
+                    if ((msg.size() >= 5) && (msg[3] < FIRMSIM_ENCODERS))
+                    {
+                        m_encoders &= ~(1 << msg[3]);
+                    }
+                    break;
+            }
+            break;
+        case 0x6f: // extended analog
+            if ((msg.size() >= 5) && (msg[2] < FIRMSIM_PINS))
+            {
+                uint32_t value = 0;
+                for (size_t i = 3; i < msg.size() - 1; ++i)
+                {
+                    value |= (msg[i] & 0x7f) << (7 * (i - 3));
+                }
+                written[msg[2]] = value;
+            }
+            break;
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * Simulated Firmata board
+ *
+ * Stands in for a serial or Bluetooth board so the daemon can be run,
+ * replayed against and benchmarked without hardware.  Answers the
+ * standard queries for a 20 pin Uno like board (PWM on 3,5,6,9,10,11,
+ * analog inputs A0-A5 on pins 14-19) and sends values for any analog
+ * channel or digital port with reporting enabled at the sampling
+ * interval.  Its serial ports are looped back, anything written to a
+ * port which is being read comes straight back as a serial reply.
+ * Attached encoders turn at a steady rate, encoder N by N+1 counts per
+ * sample in alternate directions, and are all reported in one message
+ * at the sampling interval once automatic reporting is on.
+ */
+#ifndef FIRMSIM_H
+#define FIRMSIM_H
+
+#include <vector>
+#include <deque>
+#include <stdint.h>
+
+#include "firmio.h"
+
+#define FIRMSIM_PINS 20
+#define FIRMSIM_ANALOG 6
+#define FIRMSIM_ENCODERS 5
+
+class FirmSim : public firmata::FirmIO
+{
+public:
+    FirmSim();
+    virtual ~FirmSim();
+
+    virtual void open();
+    virtual bool isOpen();
+    virtual void close();
+    virtual size_t available();
+    virtual std::vector<uint8_t> read(size_t size = 1);
+    virtual size_t write(std::vector<uint8_t> bytes);
+
+    // change what the board sees on its inputs, reported at once if
+    // reporting is enabled
+    void setAnalog(uint8_t channel, uint32_t value);
+    void setDigital(uint8_t pin, bool value);
+
+    // stop generating values at the sampling interval so that only
+    // setAnalog()/setDigital() produce samples
+    void setFreeRunning(bool on);
+
+    // last values written by the host
+    uint32_t written[FIRMSIM_PINS];
+    uint8_t modes[FIRMSIM_PINS];
+    uint64_t bytesWritten;
+
+private:
+    void handle(const std::vector<uint8_t> &msg);
+    void handleSysex(const std::vector<uint8_t> &msg);
+    void sendAnalog(uint8_t channel);
+    void sendPort(uint8_t port);
+    void sendEncoders();
+    void tick();
+
+    bool m_open;
+    bool m_freeRunning;
+    std::deque<uint8_t> m_out;
+    std::vector<uint8_t> m_in;
+    uint32_t m_analog[FIRMSIM_ANALOG];
+    uint8_t m_inputs[(FIRMSIM_PINS + 7) / 8];
+    bool m_reportAnalog[16];
+    bool m_reportPort[16];
+    uint16_t m_serialReading; // bit per serial port
+    uint8_t m_encoders; // bit per attached encoder
+    bool m_encoderAuto;
+    int32_t m_encoderPos[FIRMSIM_ENCODERS];
+    uint32_t m_interval; // ms
+    uint64_t m_nextSample;
+};
+
+#endif
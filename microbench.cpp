@@ -0,0 +1,763 @@
+/*
+ * Microbenchmarks for the scratch daemon hot paths
+ *
+ * Runs without any hardware, the daemon is linked in (built with
+ * NO_MAIN) and talks to the simulated board.  Build with
+ * "make microbench" and run
+ * ./microbench [-n iterations] [-o saveFile] [-b baselineFile]
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <new>
+#include <cstdlib>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "scratchmsg.h"
+#include "firmata.h"
+#include "firmlink.h"
+#include "firmsim.h"
+#include "adcwindow.h"
+#include "timerwheel.h"
+#include "snapshot.h"
+#include "serialpty.h"
+
+// stops the compiler discarding the work being timed
+size_t sink = 0;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// from scratchdaemon.cpp
+
+extern int scratch_fd;
+extern FirmSim* simio;
+bool connect_firmata(int type, const std::string & port);
+void disconnect_firmata();
+void dispatch_scratch_message(const unsigned char *msgbuf, unsigned int msglen);
+void read_scratch_message();
+unsigned int getpin(const std::string &s, size_t ofs, size_t end);
+void write_scratch();
+void disconnect_scratch();
+void snapshot_samples(const std::vector<link_sample> &samples);
+void process_samples();
+extern firmata::Firmata<firmata::Base, firmata::I2C>* f;
+extern FirmLink* firmlink;
+extern uint64_t reflex_count;
+extern uint64_t reflex_total_ns;
+extern uint64_t reflex_worst_ns;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// allocation counting, every allocation in the process goes through here
+
+uint64_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+typedef void (*benchfunc)(unsigned int);
+
+typedef struct
+{
+    double ns; // per op
+    double allocs; // per op
+} bench_result;
+
+std::vector<std::string> result_names;
+std::map<std::string,bench_result> results;
+std::map<std::string,bench_result> baseline;
+
+void run_bench(const char *name, benchfunc fn, unsigned int iterations)
+{
+    // warm up
+    fn(iterations / 10 + 1);
+
+    uint64_t allocs = allocations;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    fn(iterations);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    allocs = allocations - allocs;
+
+    bench_result r;
+    r.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    r.ns /= iterations;
+    r.allocs = (double)allocs / iterations;
+    result_names.push_back(name);
+    results[name] = r;
+
+    std::cout << std::left << std::setw(32) << name
+              << std::right << std::setw(10) << std::fixed << std::setprecision(1) << r.ns << " ns/op"
+              << std::setw(14) << std::setprecision(0) << (1e9 / r.ns) << " ops/s"
+              << std::setw(8) << std::setprecision(2) << r.allocs << " allocs/op";
+    std::map<std::string,bench_result>::const_iterator b = baseline.find(name);
+    if (b != baseline.end())
+    {
+        std::cout << std::setw(8) << std::showpos << std::setprecision(1)
+                  << (((r.ns - b->second.ns) * 100) / b->second.ns) << "%"
+                  << std::setw(8) << std::setprecision(2) << (r.allocs - b->second.allocs) << " allocs"
+                  << std::noshowpos;
+    }
+    std::cout << std::endl;
+}
+
+// lines of name<tab>ns<tab>allocs
+bool read_baseline(const char *path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || (line[0] == '#'))
+        {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string name;
+        bench_result r;
+        if (std::getline(fields, name, '\t') && (fields >> r.ns >> r.allocs))
+        {
+            baseline[name] = r;
+        }
+    }
+    return true;
+}
+
+bool write_results(const char *path)
+{
+    std::ofstream out(path);
+    out << "# microbench results, name ns/op allocs/op" << std::endl;
+    std::vector<std::string>::const_iterator i = result_names.begin();
+    while (i != result_names.end())
+    {
+        out << *i << "\t" << std::fixed << std::setprecision(1) << results[*i].ns
+            << "\t" << std::setprecision(2) << results[*i].allocs << std::endl;
+        ++i;
+    }
+    return out.good();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// sensor update encoding
+
+// the encoder as it was before scratchmsg.h, kept as a reference point
+void legacy_write_to_scratch(const std::ostringstream & msg)
+{
+    unsigned int len = msg.str().size();
+    std::string msgbuf;
+    msgbuf.append(1, (char)(len>>24));
+    msgbuf.append(1, (char)((len >> 16) & 0xff));
+    msgbuf.append(1, (char)((len >> 8) & 0xff));
+    msgbuf.append(1, (char)(len & 0xff));
+    msgbuf.append(msg.str());
+    sink += msgbuf.size();
+}
+
+void legacy_write_scratch_message(const std::string &msgtype, const std::string &label, int pin, uint32_t value)
+{
+    std::ostringstream msg;
+    msg << msgtype;
+    msg << " ";
+    if (label.find(' ')) { msg << "\""; }
+    msg << label;
+    msg << pin;
+    if (label.find(' ')) { msg << "\""; }
+    if (msgtype == "sensor-update") {
+        msg << " ";
+        msg << value;
+    }
+    legacy_write_to_scratch(msg);
+}
+
+void bench_encode_legacy(unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        legacy_write_scratch_message("sensor-update", "adc", i & 7, i & 1023);
+    }
+}
+
+void bench_encode(unsigned int n)
+{
+    std::string out;
+    scratch_label_table labels;
+    uint16_t ids[8];
+    for (unsigned int i = 0; i < 8; ++i)
+    {
+        ids[i] = scratch_label_intern(labels, "adc", i);
+    }
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        scratch_msg_begin(out, "sensor-update");
+        scratch_msg_append_label(out, labels, ids[i & 7]);
+        scratch_msg_append_value(out, i & 1023);
+        scratch_msg_end(out);
+        sink += out.size();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// the daemon's own paths, against the simulated board
+
+std::string msg_broadcast("broadcast \"pin13on\"");
+std::string msg_broadcast64;
+std::string msg_sensor_pairs("sensor-update \"pwm3\" 10 \"pwm5\" 20 \"pwm6\" 30 \"pwm9\" 40 "
+                             "\"pwm10\" 50 \"pwm11\" 60 \"servo2\" 70 \"servo4\" 80");
+// the same pins named with defpin
+std::string msg_named_defs("broadcast \"defpin red,pwm3\" \"defpin green,pwm5\" "
+                           "\"defpin blue,pwm6\" \"defpin left,pwm9\" \"defpin right,pwm10\" "
+                           "\"defpin fan,pwm11\" \"defpin arm,servo2\" \"defpin claw,servo4\"");
+std::string msg_named_pairs("sensor-update \"red\" 10 \"green\" 20 \"blue\" 30 \"left\" 40 "
+                            "\"right\" 50 \"fan\" 60 \"arm\" 70 \"claw\" 80");
+
+void dispatch(const std::string &msg)
+{
+    dispatch_scratch_message((const unsigned char *)msg.c_str(), msg.size());
+}
+
+void bench_broadcast(unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        dispatch(msg_broadcast);
+    }
+    sink += simio->bytesWritten;
+}
+
+void bench_broadcast64(unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        dispatch(msg_broadcast64);
+    }
+    sink += simio->bytesWritten;
+}
+
+void bench_sensor_pairs(unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        dispatch(msg_sensor_pairs);
+    }
+    sink += simio->bytesWritten;
+}
+
+void bench_named_pairs(unsigned int n)
+{
+    dispatch(msg_named_defs);
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        dispatch(msg_named_pairs);
+    }
+    sink += simio->bytesWritten;
+}
+
+// scratch_fd is pointed at one end of a Unix socket pair, or of a TCP
+// loopback connection, for reading messages and at /dev/null for
+// sending sensor updates
+int scratch_sock = -1;
+int scratch_peer = -1;
+int scratch_tcp = -1;
+int scratch_tcp_peer = -1;
+int scratch_null = -1;
+
+// as above but the message comes from a socket, as from scratch
+void read_broadcast(int sock, int peer, unsigned int n)
+{
+    std::string frame;
+    scratch_msg_begin(frame, "broadcast");
+    scratch_msg_append_quoted(frame, "pin13on");
+    scratch_msg_end(frame);
+    scratch_fd = sock;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        sink += write(peer, frame.data(), frame.size());
+        read_scratch_message();
+    }
+}
+
+// -H /path or @name
+void bench_read_broadcast(unsigned int n)
+{
+    read_broadcast(scratch_sock, scratch_peer, n);
+}
+
+// the default, scratch on localhost
+void bench_read_broadcast_tcp(unsigned int n)
+{
+    read_broadcast(scratch_tcp, scratch_tcp_peer, n);
+}
+
+// a connected pair of TCP sockets over loopback
+bool tcp_pair(int &a, int &b)
+{
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if ((l < 0) ||
+        (bind(l, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(l, 1) < 0) ||
+        (getsockname(l, (struct sockaddr *)&addr, &len) < 0))
+    {
+        return false;
+    }
+    b = socket(AF_INET, SOCK_STREAM, 0);
+    if ((b < 0) || (connect(b, (struct sockaddr *)&addr, sizeof(addr)) < 0))
+    {
+        return false;
+    }
+    a = accept(l, nullptr, nullptr);
+    close(l);
+    // each message goes as soon as it is written, as scratch sends them
+    int on = 1;
+    setsockopt(b, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return (a >= 0);
+}
+
+void bench_getpin(unsigned int n)
+{
+    std::string cmds[4] = { "pin13on", "pin2off", "config12out", "adc5" };
+    size_t starts[4] = { 3, 3, 6, 3 };
+    size_t ends[4] = { 5, 4, 9, std::string::npos };
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        sink += getpin(cmds[i & 3], starts[i & 3], ends[i & 3]);
+    }
+}
+
+// sensor updates for 8 reported pins, written to /dev/null
+void bench_report(unsigned int n)
+{
+    scratch_fd = scratch_null;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        write_scratch();
+    }
+}
+
+// the same while scratch is not reading, so that they wait in the
+// daemon and are conflated once past the high water mark
+void bench_report_stalled(unsigned int n)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    scratch_fd = fds[0];
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        write_scratch();
+    }
+    // also drops what is still waiting
+    std::streambuf *out = std::cout.rdbuf(nullptr);
+    disconnect_scratch();
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    close(fds[1]);
+    scratch_fd = scratch_null;
+}
+
+bool daemon_setup()
+{
+    if (!connect_firmata(4, ""))
+    {
+        return false;
+    }
+    simio->setFreeRunning(false);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        return false;
+    }
+    scratch_sock = fds[0];
+    scratch_peer = fds[1];
+    if (!tcp_pair(scratch_tcp, scratch_tcp_peer))
+    {
+        return false;
+    }
+    scratch_null = open("/dev/null", O_WRONLY);
+    if (scratch_null < 0)
+    {
+        return false;
+    }
+    scratch_fd = scratch_null;
+
+    // reports and pin modes in place before anything is timed
+    for (int i = 0; i < 64; ++i)
+    {
+        msg_broadcast64.append((i == 0) ? "broadcast \"" : " ");
+        msg_broadcast64.append("pin");
+        msg_broadcast64.append(std::to_string(2 + (i % 12)));
+        msg_broadcast64.append((i & 1) ? "off" : "on");
+    }
+    msg_broadcast64.append("\"");
+    dispatch(msg_broadcast64);
+    dispatch(msg_sensor_pairs);
+    dispatch("broadcast \"adc0 adc1 adc2 adc3 adc4 adc5 config7in config8in\"");
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// reflexes
+
+// from the simulated board sending an input change to the reaction
+// being written back to it, through the daemon's own parse, samples,
+// reflex and priority lane, the way its main loop runs them
+void bench_reflex(unsigned int n)
+{
+    dispatch("broadcast \"defmotor leftmotor,3,10,11\" \"defmotor rightmotor,5,12,13\"");
+    dispatch("broadcast \"reflex bumper,input7=0,leftmotor brake rightmotor brake\"");
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        simio->setDigital(7, i & 1);
+        f->parse();
+        process_samples();
+        firmlink->pump();
+    }
+    dispatch("broadcast \"reflex bumper\"");
+    sink += simio->bytesWritten;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// report scheduling
+
+// one ms tick of 64 reported channels with periods from 10ms to 2s,
+// collecting and rescheduling those due as the daemon does
+void bench_wheel(unsigned int n)
+{
+    TimerWheel wheel(1000);
+    uint64_t periods[64];
+    uint64_t due[64];
+    for (int i = 0; i < 64; ++i)
+    {
+        periods[i] = ((i & 7) == 0) ? 2000000000ull : (10000000ull * (1 + (i & 7)));
+        due[i] = periods[i];
+        wheel.add(i, due[i]);
+    }
+    std::vector<uint32_t> fired;
+    uint64_t now = 0;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        now += 1000000;
+        fired.clear();
+        wheel.expire(now, fired);
+        std::vector<uint32_t>::const_iterator t = fired.begin();
+        while (t != fired.end())
+        {
+            due[*t] += periods[*t];
+            wheel.add(*t, due[*t]);
+            ++t;
+        }
+        sink += fired.size() + (wheel.next_due_ns() & 1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// shared memory snapshot
+
+// a batch of 8 ADC samples published as the daemon does it
+void bench_snapshot(unsigned int n)
+{
+    std::string name("/microbench." + std::to_string(getpid()));
+    if (!snapshot_open(name))
+    {
+        return;
+    }
+    std::vector<link_sample> samples(8);
+    for (int i = 0; i < 8; ++i)
+    {
+        samples[i].kind = SAMPLE_ANALOG;
+        samples[i].index = i & 3;
+    }
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        for (int s = 0; s < 8; ++s)
+        {
+            samples[s].t_ns = i;
+            samples[s].value = i + s;
+        }
+        snapshot_samples(samples);
+    }
+    sink += snapshot->seq;
+    snapshot_close();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// ADC windows
+
+// one sample folded into its channel's window, as the daemon does for
+// every analog sample, with the window taken every 1000 samples
+void bench_adc_window(unsigned int n)
+{
+    adc_window windows[4];
+    for (int c = 0; c < 4; ++c)
+    {
+        adc_window_reset(windows[c]);
+    }
+    uint32_t results[ADC_RESULTS];
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        adc_window_fold(windows[i & 3], (i * 7) & 1023);
+        if ((i % 1000) == 999)
+        {
+            adc_window_take(windows[i & 3], results);
+            sink += results[ADC_RMS];
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// board serial ports on ptys
+
+FirmLink *serial_link = nullptr;
+std::vector<uint8_t> serial_out;
+void serial_bench_write(uint8_t port, const uint8_t *data, size_t size)
+{
+    serial_write_msg(serial_out, port, data, size);
+    serial_link->write(serial_out);
+}
+
+// 30 bytes written by the host to the pty, sent to the simulated board
+// which loops them back, and read by the host again, every step the
+// daemon takes for the bytes in both directions
+void bench_serial(unsigned int n)
+{
+    std::string path("/tmp/microbench.serial." + std::to_string(getpid()));
+    SerialPty ptys(serial_bench_write);
+    std::string why;
+    if (!ptys.add(path + "=hw1:115200", why))
+    {
+        return;
+    }
+    int host = open(path.c_str(), O_RDWR | O_NOCTTY);
+    if (host < 0)
+    {
+        return;
+    }
+    FirmSim *sim = new FirmSim();
+    sim->open();
+    serial_link = new FirmLink(sim);
+    std::vector<std::vector<uint8_t> > config;
+    ptys.config(config);
+    for (size_t i = 0; i < config.size(); ++i)
+    {
+        serial_link->write(config[i]);
+    }
+
+    uint8_t data[SERIAL_MAX_CHUNK];
+    memset(data, 'x', sizeof(data));
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        if (write(host, data, sizeof(data)) != sizeof(data))
+        {
+            break;
+        }
+        // the pty passes it on asynchronously
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        int fd_max = ptys.fill_fds(read_set, -1, true);
+        struct timeval tv = { 1, 0 };
+        select(fd_max + 1, &read_set, nullptr, nullptr, &tv);
+        ptys.handle(read_set);
+        serial_link->pump();
+        serial_link->read(serial_link->available());
+        ptys.send(1, serial_link->serial[1], serial_link->serial_ns[1]);
+        serial_link->serial[1].clear();
+        serial_link->serial_ports = 0;
+        ssize_t got = 0;
+        while (got < (ssize_t)sizeof(data))
+        {
+            ssize_t r = read(host, data, sizeof(data) - got);
+            if (r <= 0)
+            {
+                break;
+            }
+            got += r;
+        }
+        sink += got;
+    }
+    close(host);
+    delete serial_link;
+    serial_link = nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// encoders
+
+// the positions of 5 encoders asked for from the simulated board and
+// decoded from its one reply into samples
+void bench_encoders(unsigned int n)
+{
+    FirmSim *sim = new FirmSim();
+    sim->open();
+    sim->setFreeRunning(false);
+    FirmLink link(sim);
+    std::vector<uint8_t> msg;
+    for (uint8_t e = 0; e < FIRMSIM_ENCODERS; ++e)
+    {
+        uint8_t attach[] = { 0xf0, 0x61, 0x00, e, (uint8_t)(2 * e), (uint8_t)((2 * e) + 1), 0xf7 };
+        msg.assign(attach, attach + sizeof(attach));
+        link.write(msg);
+    }
+    uint8_t query[] = { 0xf0, 0x61, 0x02, 0xf7 };
+    msg.assign(query, query + sizeof(query));
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        link.write(msg);
+        link.pump();
+        link.read(link.available());
+        sink += link.samples.size() + link.samples.back().value;
+        link.samples.clear();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void usage(const char * progname)
+{
+    std::cout << "Usage: "<<progname<<" [-n iterations] [-o saveFile] [-b baselineFile] [-h]" << std::endl;
+    std::cout << "    -o F (save the results to F, to use as a baseline later)" << std::endl;
+    std::cout << "    -b F (show the change from the results saved in F)" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+    int c;
+    unsigned int iterations = 1000000;
+    const char *savefile = nullptr;
+
+    while ((c = getopt(argc, argv, "n:o:b:h")) >= 0)
+    {
+        switch (c)
+        {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'o':
+                savefile = optarg;
+                break;
+            case 'b':
+                if (!read_baseline(optarg))
+                {
+                    std::cerr << "Unable to read baseline " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    // the daemon talks about connecting, keep that out of the results
+    std::streambuf *out = std::cout.rdbuf(nullptr);
+    std::streambuf *err = std::cerr.rdbuf(nullptr);
+    bool ok = daemon_setup();
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    std::cerr.rdbuf(err);
+    std::cerr.clear();
+    if (!ok)
+    {
+        std::cerr << "Unable to set up the simulated board" << std::endl;
+        return 1;
+    }
+
+    run_bench("encode sensor-update (legacy)", bench_encode_legacy, iterations);
+    run_bench("encode sensor-update", bench_encode, iterations);
+    run_bench("getpin", bench_getpin, iterations);
+    run_bench("dispatch broadcast", bench_broadcast, iterations);
+    run_bench("dispatch broadcast 64 tokens", bench_broadcast64, iterations / 64);
+    run_bench("dispatch sensor-update 8 pairs", bench_sensor_pairs, iterations / 8);
+    run_bench("dispatch sensor-update 8 named pins", bench_named_pairs, iterations / 8);
+    run_bench("read+dispatch broadcast", bench_read_broadcast, iterations / 4);
+    run_bench("read+dispatch broadcast tcp", bench_read_broadcast_tcp, iterations / 4);
+    run_bench("report 8 sensors", bench_report, iterations / 8);
+    run_bench("report 8 sensors stalled scratch", bench_report_stalled, iterations / 8);
+    reflex_count = 0;
+    reflex_total_ns = 0;
+    reflex_worst_ns = 0;
+    run_bench("reflex input to reaction", bench_reflex, iterations);
+    if (reflex_count > 0)
+    {
+        std::cout << "    " << reflex_count << " reflexes, sample to reaction mean "
+                  << (reflex_total_ns / reflex_count) << " ns max " << reflex_worst_ns << " ns" << std::endl;
+    }
+    run_bench("report wheel tick 64 channels", bench_wheel, iterations);
+    run_bench("snapshot 8 samples", bench_snapshot, iterations);
+    run_bench("adc window fold", bench_adc_window, iterations);
+    run_bench("serial 30 bytes pty round trip", bench_serial, iterations / 100);
+    run_bench("encoder positions 5 encoders", bench_encoders, iterations / 10);
+
+    disconnect_firmata();
+
+    if ((savefile != nullptr) && (!write_results(savefile)))
+    {
+        std::cerr << "Unable to save results to " << savefile << std::endl;
+        return 1;
+    }
+    return (sink == 0);
+}
@@ -0,0 +1,75 @@
+/*
+ * Parsing numbers from commands
+ *
+ * Everything scratch sends is text, and a value which is not a number
+ * must be reported rather than taken as 0 or thrown over, so commands,
+ * their values and reflex conditions all go through parse_number(),
+ * which works on part of a string in place.
+ */
+#ifndef NUMPARSE_H
+#define NUMPARSE_H
+
+#include <algorithm>
+#include <string>
+#include <limits.h>
+
+// results of parse_number()
+#define PARSE_OK 0
+#define PARSE_NONE 1 // no digits
+#define PARSE_TRAILING 2 // a number followed by something else
+#define PARSE_RANGE 3 // outside min to max
+
+// parse a decimal integer from s between ofs and end, without throwing
+// or copying, returns a PARSE_ code and only sets value on PARSE_OK
+// with fraction a decimal part is allowed and dropped, scratch sends
+// computed values such as 33.5
+inline int parse_number(const std::string &s, size_t ofs, size_t end, long min, long max,
+                        bool fraction, long &value)
+{
+    end = std::min(end, s.size());
+    if (ofs >= end)
+    {
+        return PARSE_NONE;
+    }
+    const char *p = s.data() + ofs;
+    const char *last = s.data() + end;
+    bool negative = (*p == '-');
+    if (negative || (*p == '+'))
+    {
+        ++p;
+    }
+    const char *digits = p;
+    unsigned long n = 0;
+    bool big = false;
+    while ((p < last) && (*p >= '0') && (*p <= '9'))
+    {
+        n = (n * 10) + (*p++ - '0');
+        // no more than a long's worth of digits need checking for
+        big = big || (n > (unsigned long)LONG_MAX);
+    }
+    if (p == digits)
+    {
+        return PARSE_NONE;
+    }
+    if (fraction && (p < last) && (*p == '.'))
+    {
+        ++p;
+        while ((p < last) && (*p >= '0') && (*p <= '9'))
+        {
+            ++p;
+        }
+    }
+    if (p != last)
+    {
+        return PARSE_TRAILING;
+    }
+    long v = negative ? -(long)n : (long)n;
+    if (big || (v < min) || (v > max))
+    {
+        return PARSE_RANGE;
+    }
+    value = v;
+    return PARSE_OK;
+}
+
+#endif
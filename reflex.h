@@ -0,0 +1,154 @@
+/*
+ * Reflex conditions
+ *
+ * A reflex is a condition on an input pin or ADC channel which is tested
+ * against each sample as it arrives from the board, so that the daemon
+ * can react without waiting for the next report to scratch and scratch's
+ * reply.  Conditions are written as
+ *     inputN=V / inputN!=V
+ *     adcN<V / adcN<=V / adcN>V / adcN>=V / adcN=V / adcN!=V
+ * and fire once each time they become true.
+ */
+#ifndef REFLEX_H
+#define REFLEX_H
+
+#include <string>
+#include <stdint.h>
+
+#include "firmlink.h"
+#include "numparse.h"
+
+#define REFLEX_EQ 0
+#define REFLEX_NE 1
+#define REFLEX_LT 2
+#define REFLEX_LE 3
+#define REFLEX_GT 4
+#define REFLEX_GE 5
+
+typedef struct
+{
+    uint8_t kind; // SAMPLE_ANALOG or SAMPLE_DIGITAL
+    uint8_t index; // analog channel or digital port
+    uint8_t bit; // pin within digital port
+    uint8_t op;
+    uint32_t threshold;
+    bool met; // true when last sample met the condition
+} reflex_condition;
+
+// parse a condition, pin is set to the input pin or analog channel
+// returns false if not understood
+inline bool reflex_parse(const std::string &s, reflex_condition &c, unsigned int &pin)
+{
+    size_t start;
+    if (s.compare(0, 5, "input") == 0)
+    {
+        c.kind = SAMPLE_DIGITAL;
+        start = 5;
+    }
+    else if (s.compare(0, 3, "adc") == 0)
+    {
+        c.kind = SAMPLE_ANALOG;
+        start = 3;
+    }
+    else
+    {
+        return false;
+    }
+
+    size_t opstart = s.find_first_of("=!<>", start);
+    if ((opstart == std::string::npos) || (opstart == start))
+    {
+        return false;
+    }
+    long number;
+    if (parse_number(s, start, opstart, 0, 255, false, number) != PARSE_OK)
+    {
+        return false;
+    }
+    pin = number;
+
+    size_t valstart = opstart + 1;
+    switch (s[opstart])
+    {
+        case '=':
+            c.op = REFLEX_EQ;
+            break;
+        case '!':
+            if (s[valstart] != '=')
+            {
+                return false;
+            }
+            c.op = REFLEX_NE;
+            ++valstart;
+            break;
+        case '<':
+            c.op = REFLEX_LT;
+            if (s[valstart] == '=')
+            {
+                c.op = REFLEX_LE;
+                ++valstart;
+            }
+            break;
+        case '>':
+            c.op = REFLEX_GT;
+            if (s[valstart] == '=')
+            {
+                c.op = REFLEX_GE;
+                ++valstart;
+            }
+            break;
+    }
+    // samples are whole numbers, so a threshold is too
+    if (parse_number(s, valstart, std::string::npos, 0, INT32_MAX, false, number) != PARSE_OK)
+    {
+        return false;
+    }
+    c.threshold = number;
+
+    if (c.kind == SAMPLE_DIGITAL)
+    {
+        if (c.threshold > 1)
+        {
+            return false;
+        }
+        c.index = pin / 8;
+        c.bit = pin % 8;
+    }
+    else
+    {
+        c.index = pin;
+        c.bit = 0;
+    }
+    c.met = false;
+    return true;
+}
+
+// test a sample against a condition
+// returns true only when the condition has just become true
+inline bool reflex_check(reflex_condition &c, const link_sample &s)
+{
+    if ((s.kind != c.kind) || (s.index != c.index))
+    {
+        return false;
+    }
+    uint32_t value = s.value;
+    if (c.kind == SAMPLE_DIGITAL)
+    {
+        value = (value >> c.bit) & 1;
+    }
+    bool met;
+    switch (c.op)
+    {
+        case REFLEX_EQ: met = (value == c.threshold); break;
+        case REFLEX_NE: met = (value != c.threshold); break;
+        case REFLEX_LT: met = (value < c.threshold); break;
+        case REFLEX_LE: met = (value <= c.threshold); break;
+        case REFLEX_GT: met = (value > c.threshold); break;
+        default: met = (value >= c.threshold); break;
+    }
+    bool fire = (met && !c.met);
+    c.met = met;
+    return fire;
+}
+
+#endif
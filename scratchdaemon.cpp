@@ -16,8 +16,17 @@
  *         configNNin
  *         adcNN (enable ADC reporting for pin NN)
  *         adcNNoff
+ *         adcNNstats (also report min/max/mean/rms since the last report)
+ *         rateNN xx / rateadcNN xx (report input or ADC every xx ms)
  *         allon
  *         alloff
+ *         defgroup name,motor1,motor2 (then name xx,yy sets them together)
+ *         defmacro name,cmd1 cmd2 ... (then broadcast name runs them)
+ *         reflex name,condition,cmd1 cmd2 ... (run when condition becomes true)
+ *         defencoder name,pinA,pinB (then name and name-speed are reported,
+ *             name reset zeroes it)
+ *         defpin name,cmdNN (then name xx is cmdNN xx and name is reported
+ *             in place of inputNN or adcNN)
  *
  * TODO:
  *     test allon
@@ -34,7 +43,6 @@
  *         ultraNN (to put pin NN into ultrasonic mode)
  *         pinpatternBBBBB... (to set pins to list of states)
  *         1coil/2coil/halfstep (set stepper motor mode)
- *         map pin 40, switch (rename pin 40 to "switch")
  *         stepper (puts motor support into stepper mode, xx becomes steps)
  *
  *     variable supports:
@@ -53,7 +61,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/syscall.h>
 #include <string>
 #include <cstdlib>
@@ -61,14 +73,34 @@
 #include <algorithm>
 #include <cctype>
 #include <map>
+#include <unordered_set>
+#include <stdexcept>
 #include <limits.h>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <fstream>
 
 #include "firmata.h"
 #ifndef NO_BLUETOOTH
 #include "firmble.h"
 #endif
 #include "firmserial.h"
+#include "scratchmsg.h"
+#include "firmlink.h"
+#include "capture.h"
+#include "firmsim.h"
+#include "numparse.h"
+#include "reflex.h"
+#include "wsserver.h"
+#include "firmmux.h"
+#include "timerwheel.h"
+#include "snapshot.h"
+#include "adcwindow.h"
+#include "serialpty.h"
 
 bool s_debug = 0;
 #define DBG(__x...) \
@@ -101,50 +133,240 @@ void do_stop(int sig)
 
 int scratch_fd = -1;
 std::string scratch_host("127.0.0.1");
-struct sockaddr_in scratch_addr;
 int scratch_port = 42001;
+// where scratch might be, tried in turn, see scratch_resolve()
+typedef struct
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+} scratch_address;
+std::vector<scratch_address> scratch_addrs;
+
+// what the scratch socket would not take yet, whole messages apart from
+// the first scratch_partial bytes, which are the rest of a message that
+// has been partly written.  Above the high water mark sensor updates
+// are conflated to the newest value for each label, and if that is not
+// enough scratch is not reading at all and is dropped.
+#define SCRATCH_HIGH_WATER (64*1024)
+#define SCRATCH_MAX_PENDING (1024*1024)
+std::string scratch_pending;
+size_t scratch_partial = 0;
+size_t scratch_conflate_at = SCRATCH_HIGH_WATER;
+uint64_t scratch_queued = 0; // messages which had to wait
+uint64_t scratch_conflated = 0; // values dropped for a newer one
+size_t scratch_max_pending = 0;
 // milliseconds
 int samplingInterval = 100;
+// board sampling interval in ms, samplingInterval if not set
+int boardInterval = -1;
 int numPins = -1;
-bool myPins[256];
 bool reportingset[256];
-struct timeval tv;
-typedef std::function<int (const std::string&, const std::string&)> cmdfunc;
-std::map<std::string,cmdfunc> custom_commands;
+
+// pin capabilities, built once after connecting so that mode checks and
+// value scaling are table lookups rather than searches of the caps lists
+#define PIN_MODES 16
+#define NO_ANALOG 127
+typedef struct
+{
+    uint32_t caps; // bit per supported mode
+    uint8_t mode; // mode last set
+    uint8_t analog; // analog channel or NO_ANALOG
+    bool owned; // set up by the daemon, mux clients may not change it
+    uint8_t resolution[PIN_MODES];
+    uint32_t maxvalue[PIN_MODES]; // 1<<resolution
+} pin_info;
+pin_info pins[256];
+uint8_t analog_pins[128]; // analog channel to pin
+#define pin_supports(__p,__m) (((__m) < PIN_MODES) && (pins[__p].caps & (1u << (__m))))
+// when each reported pin's next update is due, see report_schedule()
+#define REPORT_TICK_US 1000
+TimerWheel report_wheel(REPORT_TICK_US);
+// if not 0, how often in us to look for data from the board between
+// messages from scratch
+int board_poll_us = 0;
+// reused for every message sent to scratch, only ever written from the
+// main loop, see report_error()
+std::string scratch_out;
+scratch_label_table scratch_labels;
 
 firmata::Firmata<firmata::Base, firmata::I2C>* f = nullptr;
 #ifndef NO_BLUETOOTH
 firmata::FirmBle* bleio = nullptr;
 #endif
 firmata::FirmSerial* serialio = nullptr;
+FirmSim* simio = nullptr;
+// wraps bleio/serialio/simio, sees everything the board sends
+FirmLink* firmlink = nullptr;
+// -W, serves websocket clients instead of connecting to scratch
+WsServer* ws = nullptr;
+std::string ws_out;
+std::vector<std::string> ws_labels; // '"name":' for each interned label
+// -M, other programs sharing the board
+FirmMux* mux = nullptr;
+// -U, board serial ports on local ptys
+SerialPty* serial_ptys = nullptr;
+
+// the board connection goes
+// disconnected -> connecting -> handshaking -> ready
+// and everything before ready happens on a background thread so that
+// a slow Bluetooth connect never holds up scratch, see board_poll()
+#define BOARD_DISCONNECTED 0
+#define BOARD_CONNECTING 1
+#define BOARD_HANDSHAKING 2
+#define BOARD_READY 3
+std::atomic<int> board_state(BOARD_DISCONNECTED);
+
+// errors from the background connect wait here for the main loop
+#define MAX_DEFERRED_ERRORS 16
+std::thread::id main_thread = std::this_thread::get_id();
+std::vector<std::string> deferred_errors;
+std::mutex deferred_lock;
 
 // report an error back to scratch, if possible
 void write_scratch_message(const std::string &msgtype, const std::string &label, const std::string &value);
 void report_error(const std::string & msg)
 {
-    if (scratch_fd != -1)
+    if (std::this_thread::get_id() != main_thread)
+    {
+        std::lock_guard<std::mutex> l(deferred_lock);
+        if (deferred_errors.size() < MAX_DEFERRED_ERRORS)
+        {
+            deferred_errors.push_back(msg);
+        }
+        return;
+    }
+    if ((scratch_fd != -1) || (ws != nullptr))
     {
         write_scratch_message("sensor-update", "error-message", msg);
     }
 }
 
-// reset timer to send next sensor updates
-void reset_timeout()
+// time taken to get going, each phase is reported the first time only
+#define STARTUP_SCRATCH 1
+#define STARTUP_FIRMATA 2
+#define STARTUP_COMMAND 4
+uint64_t startup_ns;
+int startup_done = 0;
+std::mutex startup_lock;
+
+void startup_phase(int phase, const char *name)
+{
+    std::lock_guard<std::mutex> l(startup_lock);
+    if ((startup_done & phase) == 0)
+    {
+        startup_done |= phase;
+        std::cout << "startup: " << name << " after "
+                  << ((monotonic_ns() - startup_ns) / 1000000) << " ms" << std::endl;
+    }
+}
+
+// -m, keep the shared memory snapshot in step, see snapshot.h
+void snapshot_mode(uint8_t pin, uint8_t mode)
+{
+    if (snapshot != nullptr)
+    {
+        snapshot_begin();
+        snapshot->pins[pin].mode = mode;
+        snapshot_end(monotonic_ns());
+    }
+}
+
+void snapshot_link_state(int state)
+{
+    if (snapshot != nullptr)
+    {
+        snapshot_begin();
+        snapshot->link_state = state;
+        snapshot_end(monotonic_ns());
+    }
+}
+
+// every pin as the board has just described it, nothing read yet
+void snapshot_pins()
+{
+    snapshot_begin();
+    snapshot->num_pins = numPins;
+    for (int pin = 0; pin < SNAPSHOT_PINS; ++pin)
+    {
+        snapshot_pin &s(snapshot->pins[pin]);
+        s.mode = pins[pin].mode;
+        s.analog = pins[pin].analog;
+        s.value = 0;
+        s.t_ns = 0;
+    }
+    snapshot_end(monotonic_ns());
+}
+
+// the values in one batch of samples, and the link statistics, as one
+// change
+void snapshot_samples(const std::vector<link_sample> &samples)
 {
-    tv.tv_sec = (samplingInterval / 1000);
-    tv.tv_usec = (samplingInterval * 1000) % 1000000;
+    snapshot_begin();
+    std::vector<link_sample>::const_iterator i = samples.begin();
+    while (i != samples.end())
+    {
+        if (i->kind == SAMPLE_ANALOG)
+        {
+            if (analog_pins[i->index] != NO_ANALOG)
+            {
+                snapshot_value(analog_pins[i->index], i->value, i->t_ns);
+            }
+        }
+        else if (i->kind == SAMPLE_DIGITAL)
+        {
+            // the whole port, only inputs mean anything
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                uint8_t pin = (i->index * 8) + bit;
+                if ((pins[pin].mode == MODE_INPUT) || (pins[pin].mode == MODE_PULLUP))
+                {
+                    snapshot_value(pin, (i->value >> bit) & 1, i->t_ns);
+                }
+            }
+        }
+        ++i;
+    }
+    for (int lane = 0; lane < LINK_LANES; ++lane)
+    {
+        const link_lane_stats &l(firmlink->stats[lane]);
+        snapshot_lane &s(snapshot->lanes[lane]);
+        s.sent = l.sent;
+        s.superseded = l.superseded;
+        s.conflated = l.conflated;
+        s.wait_ns = l.wait_ns;
+        s.max_wait_ns = l.max_wait_ns;
+    }
+    snapshot_end(monotonic_ns());
 }
 
-// read all current pin modes
+// read all current pin modes and capabilities
 void read_pinstates()
 {
-    // no actual action required as firmata lib does this for us
+    // firmata lib has already queried the board, copy what we need
     numPins = f->getNumPins();
     DBG("Found "<<numPins<<" pins");
+    if (numPins > 256)
+    {
+        numPins = 256;
+    }
+
+    memset(&pins[0], 0, sizeof(pins));
+    std::fill(&analog_pins[0], &analog_pins[128], NO_ANALOG);
+    for (int pin=0; pin<256; ++pin)
+    {
+        pins[pin].analog = NO_ANALOG;
+    }
 
     for (int pin=0; pin<numPins; ++pin)
     {
         const std::vector<uint8_t> &caps(f->getPinCaps(pin));
+        pin_info &p(pins[pin]);
+        p.mode = f->getPinMode(pin);
+        p.analog = f->getPinAnalogChannel(pin);
+        if (p.analog < 128)
+        {
+            analog_pins[p.analog] = pin;
+        }
         std::string comma;
         std::cout << pin << ": ";
         std::vector<uint8_t>::const_iterator i = caps.begin();
@@ -167,28 +389,110 @@ void read_pinstates()
                 case 127: std::cout << "Ignore"; break;
                 default: std::cout << "(" << (int)(*i)<<")"; break;
             }
+            if (*i < PIN_MODES)
+            {
+                p.caps |= (1u << *i);
+                p.resolution[*i] = f->getPinCapResolution(pin, *i);
+                p.maxvalue[*i] = (1u << p.resolution[*i]);
+            }
             comma=",";
             ++i;
         }
         std::cout << std::endl;
     }
+    if (snapshot != nullptr)
+    {
+        snapshot_pins();
+    }
+}
+
+// -H /path is a Unix socket and -H @name an abstract one, for scratch
+// on the same machine behind a local proxy, anything else is a host
+// name or an IPv4 or IPv6 address to reach over TCP
+// returns an empty string or why it failed
+std::string scratch_resolve()
+{
+    scratch_addrs.clear();
+    if ((scratch_host[0] == '/') || (scratch_host[0] == '@'))
+    {
+        scratch_address a;
+        memset(&a, 0, sizeof(a));
+        struct sockaddr_un *un = (struct sockaddr_un *)&a.addr;
+        if (scratch_host.size() >= sizeof(un->sun_path))
+        {
+            return "socket name too long";
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, scratch_host.data(), scratch_host.size());
+        if (scratch_host[0] == '@')
+        {
+            // abstract names start with a nul and run to the length given
+            un->sun_path[0] = '\0';
+        }
+        a.len = offsetof(struct sockaddr_un, sun_path) + scratch_host.size();
+        scratch_addrs.push_back(a);
+        return "";
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = nullptr;
+    int err = getaddrinfo(scratch_host.c_str(), std::to_string(scratch_port).c_str(), &hints, &res);
+    if (err != 0)
+    {
+        return gai_strerror(err);
+    }
+    for (struct addrinfo *i = res; i != nullptr; i = i->ai_next)
+    {
+        scratch_address a;
+        memset(&a, 0, sizeof(a));
+        memcpy(&a.addr, i->ai_addr, i->ai_addrlen);
+        a.len = i->ai_addrlen;
+        scratch_addrs.push_back(a);
+    }
+    freeaddrinfo(res);
+    return "";
 }
 
+// keep trying to connect to scratch, quickly at first then backing off
+// scratch_fd is only set once connected so nothing is sent to a socket
+// which is still connecting
 void wait_for_scratch()
 {
-    if (scratch_fd == -1)
+    useconds_t delay = 50000;
+    while (!stopping)
     {
-        scratch_fd = socket(AF_INET, SOCK_STREAM, 0);
-        DBG("scratch socket is "<<scratch_fd);
+        std::vector<scratch_address>::const_iterator i = scratch_addrs.begin();
+        while (i != scratch_addrs.end())
+        {
+            int fd = socket(i->addr.ss_family, SOCK_STREAM, 0);
+            DBG("scratch socket is "<<fd);
+            if (connect(fd, (const sockaddr *)&i->addr, i->len) == 0)
+            {
+                // writes must never hold up the board, see write_to_scratch()
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                scratch_fd = fd;
+                break;
+            }
+            // not there, keep waiting
+            DBG("waiting for scratch, errno "<<strerror(errno));
+            close(fd);
+            ++i;
+        }
+        if (scratch_fd != -1)
+        {
+            break;
+        }
+        usleep(delay);
+        delay = std::min<useconds_t>(delay * 2, 250000);
     }
-    while ((!stopping) &&
-           (connect(scratch_fd, (sockaddr *)&scratch_addr, sizeof(scratch_addr)) < 0))
+    if (scratch_fd != -1)
     {
-        // not there, keep waiting
-        DBG("waiting for scratch, errno "<<strerror(errno));
-        sleep(10);
+        startup_phase(STARTUP_SCRATCH, "connected to scratch");
+        ERR("Connected to scratch");
     }
-    ERR("Connected to scratch");
 }
 
 bool connected_to_firmata()
@@ -214,34 +518,205 @@ bool connected_to_firmata()
     return true;
 }
 
-void disconnect_firmata()
+// group writes to the board so that they go out together, nests
+int batch_depth = 0;
+void link_batch_begin()
+{
+    if ((batch_depth++ == 0) && (firmlink != nullptr))
+    {
+        firmlink->batch(true);
+#ifndef NO_BLUETOOTH
+        if (bleio) { bleio->write_batch(true); }
+#endif
+    }
+}
+
+void link_batch_end()
+{
+    if ((batch_depth > 0) && (--batch_depth == 0) && (firmlink != nullptr))
+    {
+        firmlink->batch(false);
+#ifndef NO_BLUETOOTH
+        if (bleio) { bleio->write_batch(false); }
+#endif
+    }
+}
+
+// writes that must not wait behind normal traffic, such as stopping
+// motors, go in the priority lane, nests
+int priority_depth = 0;
+void link_priority_begin()
+{
+    if ((priority_depth++ == 0) && (firmlink != nullptr))
+    {
+        firmlink->priority(true);
+    }
+}
+
+void link_priority_end()
+{
+    if ((priority_depth > 0) && (--priority_depth == 0) && (firmlink != nullptr))
+    {
+        firmlink->priority(false);
+    }
+}
+
+// writes which must reach the board together, such as the speeds of
+// both wheels of a robot
+void link_group_begin()
+{
+    link_batch_begin();
+    if (firmlink != nullptr)
+    {
+        firmlink->group(true);
+    }
+}
+
+void link_group_end()
+{
+    if (firmlink != nullptr)
+    {
+        firmlink->group(false);
+    }
+    link_batch_end();
+}
+
+// a command failed part way through, close whatever it left open but
+// keep what it and the commands before it wrote
+void link_batch_unwind()
+{
+    if (firmlink != nullptr)
+    {
+        firmlink->group(false);
+        firmlink->priority(false);
+    }
+    priority_depth = 0;
+    batch_depth = 1;
+    link_batch_end();
+}
+
+// the link is failing, drop anything batched up
+void link_batch_abort()
 {
-    if (connected_to_firmata()) {
-        DBG("Disconnecting firmata");
-        std::vector<unsigned char> r;
-        r.push_back(FIRMATA_SYSTEM_RESET);
-        f->standardCommand(r);
+    batch_depth = 0;
+    priority_depth = 0;
+    if (firmlink != nullptr)
+    {
+        firmlink->discard();
+    }
+}
+
+// bytes per second, -1 for the link type's default, 0 for no limit
+int link_rate = -1;
+
+// how long writes waited to be sent
+void link_report(const FirmLink *link)
+{
+    static const char *lanes[LINK_LANES] = { "normal", "priority" };
+    for (int lane = 0; lane < LINK_LANES; ++lane)
+    {
+        const link_lane_stats &s(link->stats[lane]);
+        if (s.sent > 0)
+        {
+            std::cout << "link: " << lanes[lane] << " " << s.sent << " sent, "
+                      << s.superseded << " replaced, " << s.conflated
+                      << " overwritten, wait mean "
+                      << (s.wait_ns / s.sent / 1000) << " us max "
+                      << (s.max_wait_ns / 1000) << " us" << std::endl;
+        }
     }
-    if (f != nullptr) {
+}
+
+// one connection to the board, built up away from the globals so that
+// it can be opened in the background, see board_install()
+typedef struct
+{
+    firmata::Firmata<firmata::Base, firmata::I2C>* f;
+#ifndef NO_BLUETOOTH
+    firmata::FirmBle* bleio;
+#endif
+    firmata::FirmSerial* serialio;
+    FirmSim* simio;
+    FirmLink* firmlink;
+} board_conn;
+
+// reset the board and free everything, safe on any thread
+void close_board(board_conn &c)
+{
+    if (c.f != nullptr) {
+        try
+        {
+            if (c.f->ready() && c.firmlink->isOpen()) {
+                DBG("Disconnecting firmata");
+                std::vector<unsigned char> r;
+                r.push_back(FIRMATA_SYSTEM_RESET);
+                c.f->standardCommand(r);
+            }
+        }
+        catch (...)
+        {
+            DBG("reset failed");
+        }
         DBG("Deleting firmata");
         // the act of deleting the firmata object will also destroy
         // the IO object too
-        delete(f);
-        f = nullptr;
+        delete(c.f);
+    } else if (c.firmlink != nullptr) {
+        // the firmata constructor failed, the link owns the IO object
+        delete c.firmlink;
+    } else {
+        // opening failed before there was a link
 #ifndef NO_BLUETOOTH
-        bleio = nullptr;
+        delete c.bleio;
 #endif
-        serialio = nullptr;
+        delete c.serialio;
+        delete c.simio;
     }
+    memset(&c, 0, sizeof(c));
+}
+
+// take the connection out of the globals
+void board_release(board_conn &c)
+{
+    c.f = f;
+#ifndef NO_BLUETOOTH
+    c.bleio = bleio;
+    bleio = nullptr;
+#endif
+    c.serialio = serialio;
+    c.simio = simio;
+    c.firmlink = firmlink;
+    f = nullptr;
+    firmlink = nullptr;
+    serialio = nullptr;
+    simio = nullptr;
+    batch_depth = 0;
+    priority_depth = 0;
+    board_state = BOARD_DISCONNECTED;
+}
+
+void disconnect_firmata()
+{
+    board_conn c;
+    board_release(c);
+    close_board(c);
 }
 
-// connect to firmata
-// p1 = conn type, 1 = serial, 2/3 = Bluetooth
+void reflex_arm_all();
+void reflex_report();
+void report_restart();
+void board_sampling_update(bool force = false);
+void serial_setup();
+void encoder_attach_all();
+
+// open a connection and wait for the board to answer, which can take
+// seconds, leaving the globals alone
+// p1 = conn type, 1 = serial, 2/3 = Bluetooth, 4 = simulated
 // p2 = port
-bool connect_firmata(int type, const std::string & port)
+bool open_board(int type, const std::string & port, board_conn &c)
 {
-    // ensure properly disconnected first
-    disconnect_firmata();
+    memset(&c, 0, sizeof(c));
+    board_state = BOARD_CONNECTING;
 
     // setup bleio/serialio
     switch (type)
@@ -250,10 +725,7 @@ bool connect_firmata(int type, const std::string & port)
             DBG("connecting to serial port "<<port);
             try
             {
-                if (serialio) {
-                    delete serialio;
-                }
-                serialio = new firmata::FirmSerial(port.c_str());
+                c.serialio = new firmata::FirmSerial(port.c_str());
             }
             catch (...)
             {
@@ -268,13 +740,10 @@ bool connect_firmata(int type, const std::string & port)
             DBG("connecting to "<<port);
             try
             {
-                if (bleio) {
-                    delete bleio;
-                }
-                bleio = new firmata::FirmBle(port.c_str());
+                c.bleio = new firmata::FirmBle(port.c_str());
                 if (s_debug) {
                     DBG("enabling debug");
-                    bleio->enableDebug();
+                    c.bleio->enableDebug();
                 }
             }
             catch (...)
@@ -283,41 +752,65 @@ bool connect_firmata(int type, const std::string & port)
             }
             break;
 #endif
-    }
 
-    if (f) {
-        delete f;
+        case 4: // simulated board
+            DBG("using simulated board");
+            c.simio = new FirmSim();
+            break;
     }
 
     ERR("Opening firmata");
 #ifndef NO_BLUETOOTH
-    if (bleio != nullptr)
+    if (c.bleio != nullptr)
     {
-        f = new firmata::Firmata<firmata::Base, firmata::I2C>(bleio);
+        c.firmlink = new FirmLink(c.bleio);
     }
 #endif
-    if (serialio != nullptr)
+    if (c.serialio != nullptr)
+    {
+        c.firmlink = new FirmLink(c.serialio);
+    }
+    if (c.simio != nullptr)
+    {
+        c.firmlink = new FirmLink(c.simio);
+    }
+    if (c.firmlink != nullptr)
     {
-        f = new firmata::Firmata<firmata::Base, firmata::I2C>(serialio);
+        // serial runs at 57600 baud, the Bluetooth figure is a safe
+        // guess at what a BLE UART service manages
+        int rate = link_rate;
+        if (rate < 0)
+        {
+            rate = (c.serialio != nullptr) ? 5760 : (c.simio != nullptr) ? 0 : 2000;
+        }
+        c.firmlink->setRate(rate);
+        c.firmlink->tap(mux != nullptr);
+        if (c.firmlink->isOpen())
+        {
+            // the firmata constructor queries the board if it can
+            board_state = BOARD_HANDSHAKING;
+        }
+        c.f = new firmata::Firmata<firmata::Base, firmata::I2C>(c.firmlink);
     }
     // firmata constructor called open()
-    if (f == nullptr)
+    if (c.f == nullptr)
     {
         ERR("failed to instantiate firmata connection");
         return false;
     }
 
 #ifndef NO_BLUETOOTH
-    if (bleio != nullptr)
+    if (c.bleio != nullptr)
     {
-        if (!bleio->isOpen())
+        if (!c.bleio->isOpen())
         {
             ERR("Connecting Bluetooth");
-            bleio->open();
-            if (bleio->isOpen())
+            c.bleio->open();
+            if (c.bleio->isOpen())
             {
                 ERR("Bluetooth now connected");
-                f->init();
+                board_state = BOARD_HANDSHAKING;
+                c.f->init();
             } else {
                 ERR("Bluetooth connect failed");
                 return false;
@@ -326,827 +819,3225 @@ bool connect_firmata(int type, const std::string & port)
     }
 #endif
 
-    if (serialio != nullptr)
+    if (c.serialio != nullptr)
     {
         // can this happen?
-        if (!serialio->isOpen())
+        if (!c.serialio->isOpen())
         {
             ERR("Connecting serial");
-            serialio->open();
-            if (serialio->isOpen())
+            c.serialio->open();
+            if (c.serialio->isOpen())
             {
                 ERR("Serial now connected");
-                f->init();
+                board_state = BOARD_HANDSHAKING;
+                c.f->init();
             } else {
                 ERR("Serial connect failed");
                 return false;
             }
         }
     }
-
-    ERR("Firmata connected and ready");
-    f->setSamplingInterval(samplingInterval);
-    read_pinstates();
-    sleep(1);
-    reset_timeout();
-    return true;
+    return c.f->ready();
 }
 
-void disconnect_scratch()
+// make an opened connection the one in use, on the main thread
+void board_install(board_conn &c)
 {
-    if (scratch_fd != -1)
-    {
-        close(scratch_fd);
-        scratch_fd = -1;
-    }
+    f = c.f;
+#ifndef NO_BLUETOOTH
+    bleio = c.bleio;
+#endif
+    serialio = c.serialio;
+    simio = c.simio;
+    firmlink = c.firmlink;
+    batch_depth = 0;
+    priority_depth = 0;
+    memset(&c, 0, sizeof(c));
+
+    ERR("Firmata connected and ready");
+    board_sampling_update(true);
+    // anything seen during the handshake is of no interest
+    firmlink->samples.clear();
+    firmlink->replies.clear();
+    read_pinstates();
+    serial_setup();
+    encoder_attach_all();
+    reflex_arm_all();
+    report_restart();
+    board_state = BOARD_READY;
+    startup_phase(STARTUP_FIRMATA, "firmata ready");
 }
 
-int do_poll()
+// connect to firmata and wait for it, for replays and benchmarks
+// p1 = conn type, 1 = serial, 2/3 = Bluetooth, 4 = simulated
+// p2 = port
+bool connect_firmata(int type, const std::string & port)
 {
-    fd_set write_set, read_set;
-    int result;
-    FD_ZERO(&read_set);
-    FD_ZERO(&write_set);
-    int fd_max = -1;
-
-    FD_SET(scratch_fd, &read_set);
-    fd_max = scratch_fd;
-
-    result = select(fd_max+1, &read_set, &write_set, nullptr, &tv);
+    // ensure properly disconnected first
+    disconnect_firmata();
 
-    if ((result < 0) && (errno != EINTR))
+    board_conn c;
+    if (!open_board(type, port, c))
     {
-        ERR("select failed, "<<strerror(errno));
-        disconnect_scratch();
-    } else if (result == 0) {
-        reset_timeout();
+        close_board(c);
+        board_state = BOARD_DISCONNECTED;
+        return false;
     }
-
-    return result;
+    board_install(c);
+    return true;
 }
 
-//////////////////////////////////////////////////////////////////////////
-//
-// Handling commands from scratch
+#ifndef NO_BLUETOOTH
+// -B remembers the last device connected to and tries it directly,
+// only scanning if that fails.  The scan runs in the background while
+// the remembered device is tried.
+std::string ble_cache_file;
+std::string ble_name_filter;
+std::string ble_port; // device to try next
+std::future<std::vector<firmata::BlePortInfo> > ble_scan;
+std::mutex ble_lock;
 
-// set pin mode in firmata if required
-void pinmode(uint8_t pin, uint8_t mode)
+// scan for devices whose name matches the filter
+std::vector<firmata::BlePortInfo> ble_list_ports()
 {
-    bool setreporting = false;
-
-    DBG("pin "<<(int)pin<<" mode "<<(int)mode);
-    if (f->getPinMode(pin) != mode)
+    DBG("Looking for bluetooth devices");
+    std::vector<firmata::BlePortInfo> ports = firmata::FirmBle::listPorts(3);
+    std::vector<firmata::BlePortInfo>::iterator i = ports.begin();
+    while (i != ports.end())
     {
-        const std::vector<uint8_t> &caps(f->getPinCaps(pin));
-        std::vector<uint8_t>::const_iterator i = caps.begin();
-        while (i != caps.end())
+        if ((!ble_name_filter.empty()) &&
+            (i->description.find(ble_name_filter) == std::string::npos))
         {
-            if (*i == mode)
-            {
-                break;
-            }
+            DBG("ignoring "<<i->port<<" "<<i->description);
+            i = ports.erase(i);
+        } else {
             ++i;
         }
-        if (i != caps.end())
-        {
-            DBG("setting pin mode");
-            f->pinMode(pin, mode);
-            setreporting = true;
-        }
-        else
-        {
-            ERR("pin "<<(int)pin<<" does not support mode "<<(int)mode);
-            return;
-        }
     }
+    return ports;
+}
 
-    // the first time thru we must always set reporting correctly
-    // even if the pin is already in the desired mode
-    if (reportingset[pin] == false)
+void ble_start_scan()
+{
+    if (!ble_scan.valid())
     {
-        setreporting = true;
+        ble_scan = std::async(std::launch::async, ble_list_ports);
     }
+}
 
-    if (setreporting)
+// pick the next device to try after exclude failed
+// returns empty string if nothing else was found
+std::string ble_next_port(const std::string &exclude)
+{
+    std::vector<firmata::BlePortInfo> ports;
+    ble_start_scan();
+    try
     {
-        // set the reporting state accordingly
-        if ((mode == MODE_INPUT) || (mode == MODE_PULLUP))
-        {
-            DBG("enable digital reporting");
-            f->reportDigitalPin(pin,1);
-        } else if (mode == MODE_ANALOG)
+        ports = ble_scan.get();
+    }
+    catch (...)
+    {
+        ERR("Failed to search for Bluetooth devices, is the adapter present?");
+    }
+    std::vector<firmata::BlePortInfo>::const_iterator i = ports.begin();
+    while (i != ports.end())
+    {
+        if (i->port != exclude)
         {
-            DBG("enable analog reporting");
-            f->reportAnalog(f->getPinAnalogChannel(pin),1);
-        } else {
-            DBG("disable reporting");
-            f->reportDigitalPin(pin,0);
-            uint8_t apin = f->getPinAnalogChannel(pin);
-            if (apin < 128) {
-                DBG("disable analog reporting on "<<(int)apin);
-                f->reportAnalog(pin,0);
-            }
+            return i->port;
         }
-        reportingset[pin] = true;
+        ++i;
     }
+    return "";
 }
 
-// parse the pin number from a subset of the string
-// returns maxint if not a valid pin number or does not end
-// at the given position
-#define BADNUMBER (UINT_MAX)
-#define BADCMD (UINT_MAX - 1)
-unsigned int getpin(const std::string &s, size_t ofs, size_t end = std::string::npos)
+std::string ble_read_cache()
 {
-    size_t newend = std::string::npos;
-    std::string n(s.substr(ofs,end-ofs));
-    unsigned int ret;
-    try
+    std::string addr;
+    std::ifstream in(ble_cache_file.c_str());
+    std::getline(in, addr);
+    return addr;
+}
+
+void ble_write_cache(const std::string &addr)
+{
+    if (ble_read_cache() == addr)
     {
-        ret = std::stoul(n,&newend);
+        return;
     }
-    catch (...)
+    std::ofstream out(ble_cache_file.c_str(), std::ios::trunc);
+    out << addr << std::endl;
+    if (!out)
     {
-        DBG("Failed to parse pin from "<<n);
-        return BADNUMBER;
-    }
-    if (newend != n.size()) {
-        DBG("only consumed "<<newend<<" chars but wanted to use "<<n.size()<<" "<< end<<" chars from "<<n);
-        return BADCMD;
+        ERR("Failed to remember Bluetooth device in "<<ble_cache_file);
     }
-    DBG("from "<<s<<" got pin "<<ret);
-    return ret;
 }
+#endif
 
-#define ends_in(__h,__n) (__h.substr(__h.length()-strlen(#__n)) == #__n)
-// set digital output pin state
-// pin1on / pin9 off
-// p1=cmd p2=value
-// value absent = parse from number
-int process_pin(const std::string &t1, const std::string &t2)
+// what is left of the last connection, closed by the next attempt
+board_conn board_old;
+// the connection an attempt opened, when it succeeds
+board_conn board_new;
+
+// connect to firmata in the background, backing off if it keeps failing
+useconds_t connect_delay = 0;
+bool try_connect_firmata(int type, const std::string & port)
 {
-    unsigned int value = UINT_MAX;
-    int ret = 2; // assume consume 2 tokens
-    size_t end = std::string::npos;
-    DBG("Parsing from "<<t1<<" "<<t2);
-    if (ends_in(t1,off)) {
-        value = 0;
-        end = t1.size() - 3;
-        ret = 1;
-    } else if (ends_in(t1,on)) {
-        value = 1;
-        end = t1.size() - 2;
-        ret = 1;
+    close_board(board_old);
+    std::string p(port);
+#ifndef NO_BLUETOOTH
+    std::unique_lock<std::mutex> l(ble_lock, std::defer_lock);
+    if (type == 3)
+    {
+        l.lock();
+        p = ble_port;
     }
-    unsigned int pin = getpin(t1,3,end);
-    if (pin == BADNUMBER) {
-        ERR("Failed to parse required pin state from "<<t1);
-        return 0;
-    } else if (pin == BADCMD) {
-        ERR("Not a valid command from "<<t1);
-        return 0;
+#endif
+    board_state = BOARD_DISCONNECTED;
+    if (connect_delay > 0)
+    {
+        usleep(connect_delay);
     }
-    if (value == UINT_MAX) {
-        // need second token
-        if ((t2 == "off") || (t2 == "low") || (t2 == "0")) {
-            value = 0;
-        } else if ((t2 == "on") || (t2 == "high") || (t2 == "1")) {
-            value = 1;
-        } else if (!t2.empty()) {
-            ERR("Failed to parse required pin state from "<<t2);
-            return 0;
+    DBG("Connecting to firmata");
+    bool ok = false;
+    try
+    {
+        ok = open_board(type, p, board_new);
+    }
+    catch (...)
+    {
+        DBG("connect failed");
+    }
+    if (ok)
+    {
+        connect_delay = 0;
+#ifndef NO_BLUETOOTH
+        if (type == 3)
+        {
+            ble_write_cache(p);
         }
+#endif
+        return true;
     }
-
-    DBG("pin "<<pin<<" set to "<<value);
-    pinmode(pin, MODE_OUTPUT);
-    myPins[pin] = false;
-    f->digitalWrite(pin,value);
-    return ret;
+    close_board(board_new);
+    board_state = BOARD_DISCONNECTED;
+    connect_delay = std::min<useconds_t>(std::max<useconds_t>(connect_delay * 2, 100000), 2000000);
+#ifndef NO_BLUETOOTH
+    if (type == 3)
+    {
+        std::string next = ble_next_port(p);
+        if (!next.empty())
+        {
+            ERR("Trying Bluetooth device "<<next<<" instead");
+            ble_port = next;
+        }
+    }
+#endif
+    return false;
 }
 
-// enable reporting for ADC pin
-// adcN / adcNoff
-// p1=cmd p2=value
-// value absent = parse from number
-// pin provided is analog pin we must map to digital
-int process_adc(const std::string &t1, const std::string &t2)
+// the board has gone, or scratch has, the next attempt resets it
+void board_drop()
 {
-    unsigned int value = UINT_MAX;
-    int ret = 2;
-    size_t end = std::string::npos;
-    DBG("Parsing from "<<t1<<" "<<t2);
-    if (ends_in(t1,off)) {
-        value = 0;
-        end = t1.size() - 3;
-        ret = 1;
-    }
-    unsigned int apin = getpin(t1,3,end);
-    if (apin == BADNUMBER) {
-        ERR("Failed to parse required pin state from "<<t1);
-        return 0;
-    } else if (apin == BADCMD) {
-        ERR("Not a valid command from "<<t1);
-        return 0;
-    }
-    if (value == UINT_MAX) {
-        // if no clue yet then try second arg
-        if (t2 == "off") {
-            value = 0;
-        } else if (t2 == "on") {
-            value = 1;
-        } else {
-            // assume command without parameters
-            value = 1;
-            ret = 1;
+    link_batch_abort();
+    if (f != nullptr)
+    {
+        link_report(firmlink);
+        reflex_report();
+        if (serial_ptys != nullptr)
+        {
+            serial_ptys->report(std::cout);
         }
+        board_release(board_old);
     }
-    unsigned int pin = f->getPinFromAnalogChannel(apin);
-    DBG("pin "<<pin<<" apin "<<apin<<" value "<<value);
-    pinmode(pin, MODE_ANALOG);
-    myPins[pin] = (value==1)?true:false;
-    f->reportAnalog(apin,value);
-    return ret;
+    board_state = BOARD_DISCONNECTED;
 }
 
-// set ddr
-// config1in / config2 out
-// p1=cmd p2=value
-// value absent = parse from number
-int process_config(const std::string &t1, const std::string &t2)
+// what scratch asked for while the board was not ready, replayed in
+// order once it is.  A broadcast sent again, or a variable set again,
+// only keeps its latest place so that a long wait cannot grow it much.
+#define BOARD_JOURNAL_MAX 256
+std::vector<std::pair<std::string, std::string> > board_journal; // key, message
+
+void board_journal_add(const std::string &key, const std::string &msg)
 {
-    unsigned int value = UINT_MAX;
-    int ret = 2;
-    size_t end = std::string::npos;
-    DBG("Parsing from "<<t1<<" "<<t2);
-    if (ends_in(t1,out)) {
-        value = MODE_OUTPUT;
-        end = t1.size() - 3;
-        ret = 1;
-    } else if (ends_in(t1,pu)) {
-        value = MODE_PULLUP;
-        end = t1.size() - 2;
-        ret = 1;
-    } else if (ends_in(t1,in)) {
-        value = MODE_INPUT;
-        end = t1.size() - 2;
-        ret = 1;
-    }
-    unsigned int pin = getpin(t1,6,end);
-    if (pin == BADNUMBER) {
-        ERR("Failed to parse required pin state from "<<t1);
-        return 0;
-    } else if (pin == BADCMD) {
-        ERR("Not a valid command from "<<t1);
-        return 0;
-    }
-    if (value == UINT_MAX) {
-        if (t2 == "out") {
-            value = MODE_OUTPUT;
-        } else if (t2 == "in") {
-            value = MODE_INPUT;
-        } else if (t2 == "pu") {
-            value = MODE_PULLUP;
-        } else if (!t2.empty()) {
-            ERR("Failed to parse required pin state from "<<t2);
-            return 0;
-        } else {
-            ERR("Failed to parse required pin state from "<<t1);
-            return 0;
+    std::vector<std::pair<std::string, std::string> >::iterator i = board_journal.begin();
+    while (i != board_journal.end())
+    {
+        if (i->first == key)
+        {
+            board_journal.erase(i);
+            break;
         }
+        ++i;
     }
-    DBG("pin "<<pin<<" value "<<value);
-    pinmode(pin, value);
-    if ((value == MODE_INPUT) || (value == MODE_PULLUP)) {
-        myPins[pin] = true;
+    if (board_journal.size() >= BOARD_JOURNAL_MAX)
+    {
+        ERR("Board not ready, forgetting "<<board_journal.front().second);
+        board_journal.erase(board_journal.begin());
     }
-    return ret;
+    board_journal.push_back(std::make_pair(key, msg));
 }
 
-// set pwm value
-// pwmNN val
-// p1=number p2=value%
-int process_pwm(const std::string &t1, const std::string &t2)
+// tokens as split by dispatch_scratch_message(), the last is a dummy
+void board_journal_tokens(bool broadcast, const std::vector<std::string> &tokens)
 {
-    DBG("Parsing from "<<t1<<" "<<t2);
-    unsigned int pin = getpin(t1,3);
-    if (pin == BADNUMBER) {
-        ERR("Failed to parse required pin state from "<<t1);
-        return 0;
-    } else if (pin == BADCMD) {
-        ERR("Not a valid command from "<<t1);
-        return 0;
+    if (broadcast)
+    {
+        std::string msg("broadcast \"");
+        for (size_t i = 1; i + 1 < tokens.size(); ++i)
+        {
+            if (i > 1) { msg.append(1, ' '); }
+            msg.append(tokens[i]);
+        }
+        msg.append(1, '"');
+        board_journal_add(msg, msg);
+        return;
+    }
+    for (size_t i = 1; i + 2 < tokens.size(); i += 2)
+    {
+        std::string msg("sensor-update \"" + tokens[i] + "\" \"" + tokens[i + 1] + "\"");
+        board_journal_add(tokens[i], msg);
     }
-    unsigned int value = std::stoul(t2);
-    DBG("pin "<<pin<<" value "<<value);
-    pinmode(pin, MODE_PWM);
-    f->analogWrite(pin,value);
-    return 2;
 }
 
-// set servo value
-// servoNN val
-// p1=number p2=value%
-int process_servo(const std::string &t1, const std::string &t2)
+void dispatch_scratch_message(const unsigned char *msgbuf, unsigned int msglen);
+void board_replay()
 {
-    DBG("Parsing from "<<t1<<" "<<t2);
-    unsigned int pin = getpin(t1,5);
-    if (pin == BADNUMBER) {
-        ERR("Failed to parse required pin state from "<<t1);
-        return 0;
-    } else if (pin == BADCMD) {
-        ERR("Not a valid command from "<<t1);
-        return 0;
+    if (board_journal.empty())
+    {
+        return;
     }
-    unsigned int value = std::stoul(t2);
-    DBG("pin "<<pin);
-    pinmode(pin, MODE_SERVO);
-    f->analogWrite(pin,value);
-    return 2;
+    DBG("replaying "<<board_journal.size()<<" messages");
+    // kept until all of it has been sent, in case the board goes again
+    std::vector<std::pair<std::string, std::string> >::const_iterator i = board_journal.begin();
+    while (i != board_journal.end())
+    {
+        dispatch_scratch_message((const unsigned char *)i->second.data(), i->second.size());
+        ++i;
+    }
+    board_journal.clear();
 }
 
-int process_pin_percent(int pin, const std::string &t2, uint8_t mode)
+// link-status as last sent to scratch, -1 to send it again
+int board_reported = -1;
+const char *board_state_names[] = { "disconnected", "connecting", "handshaking", "ready" };
+std::future<bool> board_attempt;
+
+// move the connection along, called every time round the main loop
+// returns true if the board is ready
+bool board_poll(int type, const std::string & port)
 {
-    int value = std::stoul(t2);
-    DBG("pin "<<pin<<" raw value "<<value);
-    uint32_t resolution = f->getPinCapResolution(pin,mode);
-    if (resolution > 0)
+    if ((board_state == BOARD_READY) && (!connected_to_firmata()))
     {
-        uint32_t max = (1<<resolution);
-        uint32_t scaled = (max * abs(value)) / 100;
-        if (scaled >= max)
-        {
-            scaled = max-1;
-        }
-        DBG("resolution "<<resolution<<" scaled "<<scaled);
-        pinmode(pin, mode);
-        f->analogWrite(pin,scaled);
-        return value;
+        ERR("Firmata connection lost");
+        board_drop();
     }
-    else
+    if ((board_state != BOARD_READY) && (!board_attempt.valid()))
     {
-        ERR("No pin capability for mode "<<(int)mode);
+        board_attempt = std::async(std::launch::async, try_connect_firmata, type, port);
+    }
+    if (board_attempt.valid() &&
+        (board_attempt.wait_for(std::chrono::seconds(0)) == std::future_status::ready) &&
+        board_attempt.get())
+    {
+        board_install(board_new);
     }
-    return 0;
-}
 
-void process_pin_percent(const std::string &t1, const std::string &t2, size_t baseLen, uint8_t mode)
-{
-    DBG("Parsing from "<<t1<<" "<<t2);
-    unsigned int pin;
-    if (t1[baseLen] == 'a')
+    std::vector<std::string> errors;
     {
-        pin = 11;
+        std::lock_guard<std::mutex> l(deferred_lock);
+        errors.swap(deferred_errors);
     }
-    else if (t1[baseLen] == 'b')
+    std::vector<std::string>::const_iterator i = errors.begin();
+    while (i != errors.end())
     {
-        pin = 12;
+        report_error(*i);
+        ++i;
     }
-    else {
-        pin = getpin(t1,baseLen);
-        if (pin == BADNUMBER) {
-            ERR("Failed to parse required pin state from "<<t1);
-            return;
-        } else if (pin == BADCMD) {
-            ERR("Not a valid command from "<<t1);
-            return;
-        }
+    int state = board_state;
+    if (state != board_reported)
+    {
+        board_reported = state;
+        snapshot_link_state(state);
+        write_scratch_message("sensor-update", "link-status", board_state_names[state]);
     }
-    process_pin_percent(pin, t2, mode);
-}
 
-// motor speed - alias for pwm
-// motorA = motor11
-// motorB = motor12
-// motorNN val
-// p1=number p2=value
-int process_motor(const std::string &t1, const std::string &t2)
-{
-    process_pin_percent(t1, t2, 5, MODE_PWM);
-    return 2;
+    if (state == BOARD_READY)
+    {
+        board_replay();
+        return true;
+    }
+    return false;
 }
 
-// power - alias for pwm
-// powerA = power11
-// powerB = power12
-// powerNN val
-// p1=number p2=value
-int process_power(const std::string &t1, const std::string &t2)
+// wait for any attempt and close everything, on the way out
+void board_shutdown()
 {
-    process_pin_percent(t1, t2, 5, MODE_PWM);
-    return 2;
+    if (board_attempt.valid() && board_attempt.get())
+    {
+        close_board(board_new);
+    }
+    close_board(board_old);
+    disconnect_firmata();
 }
 
-// set all pins
-// allpins value
-int process_allpins(const std::string &t1, const std::string &t2)
+void disconnect_scratch()
 {
-    unsigned int value;
-    size_t end = std::string::npos;
-    DBG("Parsing from "<<t1<<" "<<t2);
-    if ((t2 == "off") || (t2 == "low") || (t2 == "0")) {
-        value = 0;
-    } else if ((t2 == "on") || (t2 == "high") || (t2 == "1")) {
-        value = 1;
-    } else if (!t2.empty()) {
-        ERR("Failed to parse required pin state from "<<t2);
-        return 0;
+    if (scratch_fd != -1)
+    {
+        close(scratch_fd);
+        scratch_fd = -1;
     }
-    // find all digital IO pins and iterate over them
-    for (uint8_t pin = 0; pin<numPins; ++pin)
+    if (scratch_queued > 0)
     {
-        // only update pins which are digital outputs
-        if (f->getPinMode(pin) == MODE_OUTPUT)
-        {
-            DBG("pin "<<pin<<" value "<<value);
-            f->digitalWrite(pin, value);
-        }
+        std::cout << "scratch: " << scratch_queued << " messages waited, "
+                  << scratch_conflated << " values overwritten, most waiting "
+                  << scratch_max_pending << " bytes" << std::endl;
     }
-    return 2;
+    scratch_pending.clear();
+    scratch_partial = 0;
+    scratch_conflate_at = SCRATCH_HIGH_WATER;
+    scratch_queued = 0;
+    scratch_conflated = 0;
+    scratch_max_pending = 0;
 }
 
-// set all pins on
-// allpins value
-int process_allon(const std::string &t1, const std::string &t2)
+// how often to send queued writes when the link is busy
+#define LINK_POLL_US 1000
+// most time between looking at the board while mux clients are connected
+#define MUX_POLL_US 2000
+// and while board serial ports are on ptys
+#define SERIAL_POLL_US 2000
+// how often to look for the board connection making progress
+#define BOARD_POLL_US 20000
+int do_poll(fd_set &read_set, fd_set &write_set)
 {
-    process_allpins("allpins","on");
-    return 1;
-}
+    int result;
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+    int fd_max = -1;
 
-// set all pins off
-// allpins value
-int process_alloff(const std::string &t1, const std::string &t2)
+    if (scratch_fd >= 0)
+    {
+        FD_SET(scratch_fd, &read_set);
+        if (!scratch_pending.empty())
+        {
+            FD_SET(scratch_fd, &write_set);
+        }
+        fd_max = scratch_fd;
+    }
+    if (ws != nullptr)
+    {
+        fd_max = ws->fill_fds(read_set, write_set, fd_max);
+    }
+    if (mux != nullptr)
+    {
+        fd_max = mux->fill_fds(read_set, write_set, fd_max);
+    }
+    if (serial_ptys != nullptr)
+    {
+        // what the host writes waits in the pty until the link has room
+        bool reading = (board_state == BOARD_READY) && (!firmlink->queued());
+        fd_max = serial_ptys->fill_fds(read_set, fd_max, reading);
+    }
+
+    // wait until the next updates are due, or less if the board needs
+    // looking at sooner
+    uint64_t now = monotonic_ns();
+    uint64_t due = report_wheel.next_due_ns();
+    uint64_t wait_us = samplingInterval * 1000ull;
+    if (board_state != BOARD_READY)
+    {
+        // nothing is reported, just look for the board coming up
+        wait_us = BOARD_POLL_US;
+    }
+    else if (due != TW_NONE)
+    {
+        wait_us = (due > now) ? ((due - now + 999) / 1000) : 0;
+    }
+    if ((board_poll_us > 0) && (wait_us > (uint64_t)board_poll_us))
+    {
+        wait_us = board_poll_us;
+    }
+    if ((firmlink != nullptr) && firmlink->queued() && (wait_us > LINK_POLL_US))
+    {
+        // writes are waiting for the link
+        wait_us = LINK_POLL_US;
+    }
+    if ((mux != nullptr) && (mux->clients() > 0) && (wait_us > MUX_POLL_US))
+    {
+        // mux clients expect replies about as soon as the board sends them
+        wait_us = MUX_POLL_US;
+    }
+    if ((serial_ptys != nullptr) && (board_state == BOARD_READY) && (wait_us > SERIAL_POLL_US))
+    {
+        // as do serial devices
+        wait_us = SERIAL_POLL_US;
+    }
+    struct timeval tv;
+    tv.tv_sec = wait_us / 1000000;
+    tv.tv_usec = wait_us % 1000000;
+
+    result = select(fd_max+1, &read_set, &write_set, nullptr, &tv);
+
+    if ((result < 0) && (errno != EINTR))
+    {
+        ERR("select failed, "<<strerror(errno));
+        disconnect_scratch();
+    }
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Set of pins being reported to scratch
+//
+// kept as a dense list so that sending the updates only has to visit the
+// pins scratch asked for, report_slot[] maps a pin back to its entry
+// (index + 1, so that it starts out as NO_REPORT)
+//
+// each pin is reported on its own period, the reporting interval unless
+// set with rateNN, on a timer wheel.  Periods are counted from a common
+// start so that pins whose periods are multiples of each other fall due
+// together and are sent in one message.
+
+#define REPORT_ADC 0
+#define REPORT_INPUT 1
+#define REPORT_ADC_STATS 2 // with the window of samples since the last report
+#define NO_REPORT 0
+typedef struct
 {
-    process_allpins("allpins","off");
-    return 1;
+    uint8_t pin;
+    uint8_t kind;
+    uint16_t label; // interned sensor name
+    uint32_t last; // value last sent to scratch
+    uint64_t due_ns; // next report
+} report_entry;
+std::vector<report_entry> reports;
+int16_t report_slot[256];
+
+#define REPORT_MAX_PERIOD_MS 3600000
+uint64_t report_epoch_ns = 0;
+uint32_t report_period_ms[256]; // 0 for samplingInterval
+std::vector<uint32_t> report_fired;
+
+// every sample of the first ADC_WINDOW_CHANNELS analog channels is folded
+// into its window, taken and restarted when the channel is reported
+adc_window adc_windows[ADC_WINDOW_CHANNELS];
+uint16_t adc_window_labels[ADC_WINDOW_CHANNELS][ADC_RESULTS]; // adcN-min etc
+
+// names given to pins with defpin, reported in place of inputNN and
+// adcNN (by analog channel)
+std::string input_names[256];
+std::string adc_names[128];
+
+uint16_t input_label(uint8_t pin)
+{
+    if (input_names[pin].empty())
+    {
+        return scratch_label_intern(scratch_labels, "input", pin);
+    }
+    return scratch_label_intern(scratch_labels, input_names[pin]);
+}
+
+// with stats the labels for the channel's window are set up too
+uint16_t adc_label(uint8_t apin, bool stats)
+{
+    std::string label(adc_names[apin].empty() ? "adc" + std::to_string(apin) : adc_names[apin]);
+    if (stats)
+    {
+        static const char *suffix[ADC_RESULTS] = { "-min", "-max", "-mean", "-rms" };
+        for (int r = 0; r < ADC_RESULTS; ++r)
+        {
+            adc_window_labels[apin][r] = scratch_label_intern(scratch_labels, label + suffix[r]);
+        }
+    }
+    return scratch_label_intern(scratch_labels, label);
 }
 
+// quadrature encoders counted on the board (Firmata encoder feature),
+// which sends every position in one message each time it samples.
+// scratch gets the position and speed of each every reporting interval,
+// all in the same sensor-update as anything else due then.
+#define ENCODER_DATA 0x61
+#define ENCODER_ATTACH 0x00
+#define ENCODER_RESET_POSITION 0x03
+#define ENCODER_REPORT_AUTO 0x04
+#define ENCODER_DETACH 0x05
+#define MAX_ENCODERS 5
+// report_wheel timer id, past any pin
+#define ENCODER_TIMER 256
 typedef struct
 {
-    uint8_t in1;
-    uint8_t in2;
-    uint8_t pwm;
-} tb6612fng;
-std::map<std::string,tb6612fng> tb6612fng_list;
+    std::string name;
+    uint8_t pin_a;
+    uint8_t pin_b;
+    uint16_t label; // name
+    uint16_t speed_label; // name-speed
+    int32_t position; // latest from the board
+    uint64_t t_ns; // when it arrived, 0 if nothing has yet
+    int32_t reported; // position last sent to scratch
+    uint64_t reported_ns; // and when that arrived from the board
+} encoder_info;
+std::vector<encoder_info> encoders; // index is the number on the board
+uint64_t encoder_due_ns = 0;
 
-// motorname = custom name for motor
-// motorname % or motorname -% or motorname stop or motorname brake
-int process_setmotor(const std::string &t1, const std::string &t2)
+void encoder_schedule(uint64_t now)
 {
-    std::map<std::string,tb6612fng>::iterator i = tb6612fng_list.find(t1);
-    if (i == tb6612fng_list.end())
+    uint64_t period = samplingInterval * 1000000ull;
+    if (period == 0)
     {
-        ERR("Failed to find motor entry "<<t1);
-        return 0;
+        // never due rather than dividing by nothing
+        encoder_due_ns = UINT64_MAX;
+        return;
     }
-    DBG("Setting motor "<<t1<<" to "<<t2);
+    encoder_due_ns = report_epoch_ns + ((((now - report_epoch_ns) / period) + 1) * period);
+    report_wheel.add(ENCODER_TIMER, encoder_due_ns);
+}
 
-    if (t2 == "stop")
+// schedule the entry's next report, the first multiple of its period
+// after now
+void report_schedule(report_entry &e, uint64_t now)
+{
+    uint32_t ms = report_period_ms[e.pin];
+    uint64_t period = ((ms > 0) ? ms : samplingInterval) * 1000000ull;
+    if (period == 0)
     {
-        f->digitalWrite(i->second.in1,0);
-        f->digitalWrite(i->second.in2,0);
-        f->analogWrite(i->second.pwm,0);
+        // never due rather than dividing by nothing
+        e.due_ns = UINT64_MAX;
+        return;
     }
-    else if (t2 == "brake")
+    e.due_ns = report_epoch_ns + ((((now - report_epoch_ns) / period) + 1) * period);
+    // the pin is the timer id, any timer left from an earlier schedule
+    // is ignored when it fires as due_ns will not have been reached
+    report_wheel.add(e.pin, e.due_ns);
+}
+
+// the board samples as often as the fastest reported pin needs, unless
+// set with -I
+int board_sampling_ms = -1; // last set
+void board_sampling_update(bool force)
+{
+    int ms = samplingInterval;
+    if (boardInterval > 0)
     {
-        f->digitalWrite(i->second.in1,1);
-        f->digitalWrite(i->second.in2,1);
-        f->analogWrite(i->second.pwm,0);
+        ms = boardInterval;
     }
     else
     {
-        int speed = process_pin_percent(i->second.pwm, t2, MODE_PWM);
-        if (speed == 0)
+        std::vector<report_entry>::const_iterator i = reports.begin();
+        while (i != reports.end())
         {
-            f->digitalWrite(i->second.in1,0);
-            f->digitalWrite(i->second.in2,0);
+            int period = report_period_ms[i->pin];
+            if ((period > 0) && (period < ms))
+            {
+                ms = period;
+            }
+            ++i;
         }
-        else if (speed > 0)
+    }
+    if ((f != nullptr) && (force || (ms != board_sampling_ms)))
+    {
+        DBG("board sampling every "<<ms<<" ms");
+        f->setSamplingInterval(ms);
+        board_sampling_ms = ms;
+    }
+}
+
+// start reporting periods again from now, e.g. on connecting
+void report_restart()
+{
+    uint64_t now = monotonic_ns();
+    report_epoch_ns = now;
+    report_wheel.reset(now);
+    std::vector<report_entry>::iterator i = reports.begin();
+    while (i != reports.end())
+    {
+        report_schedule(*i, now);
+        ++i;
+    }
+    if (!encoders.empty())
+    {
+        encoder_schedule(now);
+    }
+}
+
+void report_add(uint8_t pin, uint8_t kind, uint16_t label)
+{
+    if (report_slot[pin] == NO_REPORT)
+    {
+        reports.push_back(report_entry());
+        report_slot[pin] = reports.size();
+    }
+    report_entry &e(reports[report_slot[pin] - 1]);
+    DBG("reporting pin "<<(int)pin<<" kind "<<(int)kind<<" as"<<scratch_labels.quoted[label]);
+    e.pin = pin;
+    e.kind = kind;
+    e.label = label;
+    e.last = UINT32_MAX;
+    report_schedule(e, monotonic_ns());
+    board_sampling_update();
+}
+
+void report_remove(uint8_t pin)
+{
+    int16_t slot = report_slot[pin];
+    if (slot == NO_REPORT)
+    {
+        return;
+    }
+    DBG("no longer reporting pin "<<(int)pin);
+    // move the last entry into the hole to keep the list dense
+    reports[slot - 1] = reports.back();
+    report_slot[reports[slot - 1].pin] = slot;
+    reports.pop_back();
+    report_slot[pin] = NO_REPORT;
+    board_sampling_update();
+}
+
+// drop a pin from the reporting set if its new mode cannot be reported
+// as it is currently listed
+void report_mode_changed(uint8_t pin, uint8_t mode)
+{
+    int16_t slot = report_slot[pin];
+    if (slot == NO_REPORT)
+    {
+        return;
+    }
+    switch (reports[slot - 1].kind)
+    {
+        case REPORT_ADC:
+        case REPORT_ADC_STATS:
+            if (mode == MODE_ANALOG) return;
+            break;
+        case REPORT_INPUT:
+            if ((mode == MODE_INPUT) || (mode == MODE_PULLUP)) return;
+            break;
+    }
+    report_remove(pin);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Handling commands from scratch
+
+// set pin mode in firmata if required
+// returns false if the pin does not support the mode
+bool pinmode(uint8_t pin, uint8_t mode)
+{
+    bool setreporting = false;
+
+    DBG("pin "<<(int)pin<<" mode "<<(int)mode);
+    if (pins[pin].mode != mode)
+    {
+        if (pin_supports(pin, mode))
         {
-            f->digitalWrite(i->second.in1,1);
-            f->digitalWrite(i->second.in2,0);
+            DBG("setting pin mode");
+            f->pinMode(pin, mode);
+            pins[pin].mode = mode;
+            snapshot_mode(pin, mode);
+            setreporting = true;
         }
         else
         {
-            f->digitalWrite(i->second.in1,0);
-            f->digitalWrite(i->second.in2,1);
+            ERR("pin "<<(int)pin<<" does not support mode "<<(int)mode);
+            return false;
         }
     }
-    return 2;
+    pins[pin].owned = true;
+    firmlink->claimPin(pin);
+    report_mode_changed(pin, mode);
+
+    // the first time thru we must always set reporting correctly
+    // even if the pin is already in the desired mode
+    if (reportingset[pin] == false)
+    {
+        setreporting = true;
+    }
+
+    if (setreporting)
+    {
+        // set the reporting state accordingly
+        if ((mode == MODE_INPUT) || (mode == MODE_PULLUP))
+        {
+            DBG("enable digital reporting");
+            f->reportDigitalPin(pin,1);
+        } else if (mode == MODE_ANALOG)
+        {
+            DBG("enable analog reporting");
+            f->reportAnalog(pins[pin].analog,1);
+        } else {
+            DBG("disable reporting");
+            f->reportDigitalPin(pin,0);
+            uint8_t apin = pins[pin].analog;
+            if (apin != NO_ANALOG) {
+                DBG("disable analog reporting on "<<(int)apin);
+                f->reportAnalog(apin,0);
+            }
+        }
+        reportingset[pin] = true;
+    }
+    return true;
 }
 
-// define a motor controlled by a TB6612FNG
-// defmotor "motorname,pwmPin,in1Pin,in2Pin"
-int process_defmotor(const std::string &t1, const std::string &t2)
+// parse the pin number from a subset of the string
+// returns maxint if not a valid pin number, i.e. not one the board has
+// or once that is not known beyond the 256 a uint8_t holds, or does
+// not end at the given position
+#define BADNUMBER (UINT_MAX)
+#define BADCMD (UINT_MAX - 1)
+unsigned int getpin(const std::string &s, size_t ofs, size_t end = std::string::npos)
 {
-    DBG("t1 "<<t1<<" t2 "<<t2);
-    int j = 0;
-    std::string token;
-    std::string name;
-    int pwm, pin1, pin2;
-    size_t start = 0, end = 0;
-    while (end != std::string::npos) {
-        end = t2.find(',', start);
-        token.assign(t2.substr( start, (end == std::string::npos) ? std::string::npos : end - start));
-        start = ( end > (std::string::npos - 1)) ?  std::string::npos  :  (end + 1);
-        DBG("Token: " << token);
-        switch (j)
-        {
-            case 0: // motorname
-                name.assign(token);
-                DBG("Motor "<<name);
-                break;
-            case 1: // pwm pin
-                pwm = stoul(token);
-                DBG("pwm "<<pwm);
-                break;
-            case 2: // pin1
-                pin1 = stoul(token);
-                DBG("pin1 "<<pin1);
-                break;
-            case 3: // pin2
-                pin2 = stoul(token);
-                DBG("pin2 "<<pin2);
-                break;
+    long ret;
+    long max = (numPins > 0) ? (numPins - 1) : 255;
+    switch (parse_number(s, ofs, end, 0, max, false, ret))
+    {
+        case PARSE_OK:
+            break;
+        case PARSE_TRAILING:
+            DBG("pin in "<<s<<" does not end at "<<end);
+            return BADCMD;
+        default:
+            DBG("Failed to parse pin from "<<s);
+            return BADNUMBER;
+    }
+    DBG("from "<<s<<" got pin "<<ret);
+    return ret;
+}
+
+// parse the whole of a value scratch sent, false if it is not a number
+// from min to max
+bool getvalue(const std::string &s, long min, long max, int32_t &value)
+{
+    long v;
+    if (parse_number(s, 0, std::string::npos, min, max, true, v) != PARSE_OK)
+    {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+#define ends_in(__h,__n) ((__h.size() >= strlen(#__n)) && \
+    (__h.compare(__h.size() - strlen(#__n), std::string::npos, #__n) == 0))
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Compiled commands
+//
+// each command from scratch is resolved to the function which carries it
+// out plus the pin and value it applies to, and then run.  Macros keep
+// the resolved actions so running them needs no further parsing.
+
+typedef struct
+{
+    uint8_t in1;
+    uint8_t in2;
+    uint8_t pwm;
+} tb6612fng;
+std::map<std::string,tb6612fng> tb6612fng_list;
+
+// motors which are set together
+#define MAX_GROUP_MOTORS 4
+#define GROUP_BRAKE INT8_MIN // speed value
+typedef struct
+{
+    std::vector<const tb6612fng *> motors;
+} motor_group;
+std::map<std::string,motor_group> motor_groups;
+
+struct scratch_action;
+typedef void (*actionfunc)(const struct scratch_action &);
+typedef struct scratch_action
+{
+    actionfunc run;
+    uint8_t pin;
+    uint8_t mode;
+    int32_t value;
+    const tb6612fng *motor;
+    const std::vector<struct scratch_action> *macro;
+    const motor_group *group;
+    int8_t speeds[MAX_GROUP_MOTORS]; // % for each motor in group
+    bool priority; // goes ahead of other writes to the board
+} scratch_action;
+typedef std::vector<scratch_action> action_list;
+
+// p1=cmd p2=value p3=action to fill in, returns tokens consumed or 0
+typedef std::function<int (const std::string&, const std::string&, scratch_action&)> cmdfunc;
+std::map<std::string,cmdfunc> custom_commands;
+
+// set digital output pin state
+void run_digital(const scratch_action &a)
+{
+    DBG("pin "<<(int)a.pin<<" set to "<<a.value);
+    pinmode(a.pin, MODE_OUTPUT);
+    f->digitalWrite(a.pin,a.value);
+}
+
+// enable or disable reporting for ADC, pin is the analog channel
+// value is 0 (off), 1 (on) or ADC_STATS (on with the window)
+#define ADC_STATS 2
+void run_adc(const scratch_action &a)
+{
+    uint8_t pin = analog_pins[a.pin];
+    if (pin == NO_ANALOG) {
+        ERR("No such analog channel "<<(int)a.pin);
+        return;
+    }
+    DBG("pin "<<(int)pin<<" apin "<<(int)a.pin<<" value "<<a.value);
+    if (pinmode(pin, MODE_ANALOG) && (a.value != 0)) {
+        uint8_t kind = REPORT_ADC;
+        if (a.value == ADC_STATS) {
+            adc_window_reset(adc_windows[a.pin]);
+            kind = REPORT_ADC_STATS;
+        }
+        report_add(pin, kind, adc_label(a.pin, kind == REPORT_ADC_STATS));
+    } else {
+        report_remove(pin);
+    }
+    f->reportAnalog(a.pin,(a.value != 0));
+}
+
+// set how often a pin is reported, value is the period in ms
+void run_rate(const scratch_action &a)
+{
+    DBG("pin "<<(int)a.pin<<" period "<<a.value);
+    report_period_ms[a.pin] = a.value;
+    int16_t slot = report_slot[a.pin];
+    if (slot != NO_REPORT)
+    {
+        report_schedule(reports[slot - 1], monotonic_ns());
+        board_sampling_update();
+    }
+}
+
+// set pin mode, reporting inputs
+void run_config(const scratch_action &a)
+{
+    DBG("pin "<<(int)a.pin<<" value "<<(int)a.mode);
+    if (pinmode(a.pin, a.mode) &&
+        ((a.mode == MODE_INPUT) || (a.mode == MODE_PULLUP))) {
+        report_add(a.pin, REPORT_INPUT, input_label(a.pin));
+    }
+}
+
+// write a raw pwm or servo value
+void run_analog(const scratch_action &a)
+{
+    DBG("pin "<<(int)a.pin<<" mode "<<(int)a.mode<<" value "<<a.value);
+    pinmode(a.pin, a.mode);
+    f->analogWrite(a.pin,a.value);
+}
+
+// scale value as a percentage of the pin's range
+// returns false if the pin cannot do mode
+bool percent_scale(uint8_t pin, int value, uint8_t mode, uint32_t &scaled)
+{
+    if (!pin_supports(pin, mode) || (pins[pin].resolution[mode] == 0))
+    {
+        return false;
+    }
+    uint32_t max = pins[pin].maxvalue[mode];
+    scaled = (max * abs(value)) / 100;
+    if (scaled >= max)
+    {
+        scaled = max-1;
+    }
+    DBG("max "<<max<<" scaled "<<scaled);
+    return true;
+}
+
+// write value as a percentage of the pin's range
+// returns value if written, 0 if the pin cannot do it
+int pin_percent(uint8_t pin, int value, uint8_t mode)
+{
+    DBG("pin "<<(int)pin<<" raw value "<<value);
+    uint32_t scaled;
+    if (percent_scale(pin, value, mode, scaled))
+    {
+        pinmode(pin, mode);
+        f->analogWrite(pin,scaled);
+        return value;
+    }
+    else
+    {
+        ERR("No pin capability for mode "<<(int)mode);
+    }
+    return 0;
+}
+
+void run_percent(const scratch_action &a)
+{
+    pin_percent(a.pin, a.value, a.mode);
+}
+
+// set all digital outputs
+void run_allpins(const scratch_action &a)
+{
+    // find all digital IO pins and iterate over them
+    for (uint8_t pin = 0; pin<numPins; ++pin)
+    {
+        // only update pins which are digital outputs
+        if (pins[pin].mode == MODE_OUTPUT)
+        {
+            DBG("pin "<<(int)pin<<" value "<<a.value);
+            f->digitalWrite(pin, a.value);
+        }
+    }
+}
+
+void run_motor_stop(const scratch_action &a)
+{
+    f->digitalWrite(a.motor->in1,0);
+    f->digitalWrite(a.motor->in2,0);
+    f->analogWrite(a.motor->pwm,0);
+}
+
+void run_motor_brake(const scratch_action &a)
+{
+    f->digitalWrite(a.motor->in1,1);
+    f->digitalWrite(a.motor->in2,1);
+    f->analogWrite(a.motor->pwm,0);
+}
+
+// value is % of full speed, negative for reverse
+void run_motor_speed(const scratch_action &a)
+{
+    int speed = pin_percent(a.motor->pwm, a.value, MODE_PWM);
+    if (speed == 0)
+    {
+        f->digitalWrite(a.motor->in1,0);
+        f->digitalWrite(a.motor->in2,0);
+    }
+    else if (speed > 0)
+    {
+        f->digitalWrite(a.motor->in1,1);
+        f->digitalWrite(a.motor->in2,0);
+    }
+    else
+    {
+        f->digitalWrite(a.motor->in1,0);
+        f->digitalWrite(a.motor->in2,1);
+    }
+}
+
+// set every motor in a group, the direction and speed of each are all
+// worked out before any of them are written to the board
+void run_group(const scratch_action &a)
+{
+    const std::vector<const tb6612fng *> &motors(a.group->motors);
+    uint8_t in1[MAX_GROUP_MOTORS];
+    uint8_t in2[MAX_GROUP_MOTORS];
+    uint32_t duty[MAX_GROUP_MOTORS];
+    for (size_t i = 0; i < motors.size(); ++i)
+    {
+        int speed = a.speeds[i];
+        duty[i] = 0;
+        if (speed == GROUP_BRAKE)
+        {
+            in1[i] = 1;
+            in2[i] = 1;
+            continue;
+        }
+        if (speed != 0)
+        {
+            if (percent_scale(motors[i]->pwm, speed, MODE_PWM, duty[i]))
+            {
+                pinmode(motors[i]->pwm, MODE_PWM);
+            }
+            else
+            {
+                ERR("No pin capability for mode "<<(int)MODE_PWM);
+                speed = 0;
+            }
+        }
+        in1[i] = (speed > 0);
+        in2[i] = (speed < 0);
+    }
+
+    link_group_begin();
+    for (size_t i = 0; i < motors.size(); ++i)
+    {
+        f->digitalWrite(motors[i]->in1,in1[i]);
+        f->digitalWrite(motors[i]->in2,in2[i]);
+    }
+    for (size_t i = 0; i < motors.size(); ++i)
+    {
+        f->analogWrite(motors[i]->pwm,duty[i]);
+    }
+    link_group_end();
+}
+
+void run_action(const scratch_action &a)
+{
+    if (a.priority)
+    {
+        link_priority_begin();
+        a.run(a);
+        link_priority_end();
+    }
+    else
+    {
+        a.run(a);
+    }
+}
+
+// run each action in a macro, sent to the board as one batch
+#define MAX_MACRO_DEPTH 8
+int macro_depth = 0;
+void run_macro(const scratch_action &a)
+{
+    if (macro_depth >= MAX_MACRO_DEPTH)
+    {
+        ERR("Macros nested too deeply");
+        return;
+    }
+    ++macro_depth;
+    link_batch_begin();
+    action_list::const_iterator i = a.macro->begin();
+    while (i != a.macro->end())
+    {
+        run_action(*i);
+        ++i;
+    }
+    link_batch_end();
+    --macro_depth;
+}
+
+// the second half of each command which applies to a pin, with the pin
+// already known, so that a pin named with defpin is bound to one of
+// these when it is defined
+// p1=pin p2=value, returns tokens consumed or 0
+typedef int (*pinfunc)(unsigned int, const std::string&, scratch_action&);
+
+// pinNN value
+int compile_pin_bound(unsigned int pin, const std::string &t2, scratch_action &a)
+{
+    unsigned int value = UINT_MAX;
+    if ((t2 == "off") || (t2 == "low") || (t2 == "0")) {
+        value = 0;
+    } else if ((t2 == "on") || (t2 == "high") || (t2 == "1")) {
+        value = 1;
+    } else if (!t2.empty()) {
+        ERR("Failed to parse required pin state from "<<t2);
+        return 0;
+    }
+    a.run = run_digital;
+    a.pin = pin;
+    a.value = value;
+    return 2;
+}
+
+// set digital output pin state
+// pin1on / pin9 off
+// p1=cmd p2=value
+// value absent = parse from number
+int compile_pin(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    unsigned int value = UINT_MAX;
+    int ret = 2; // assume consume 2 tokens
+    size_t end = std::string::npos;
+    DBG("Parsing from "<<t1<<" "<<t2);
+    if (ends_in(t1,off)) {
+        value = 0;
+        end = t1.size() - 3;
+        ret = 1;
+    } else if (ends_in(t1,on)) {
+        value = 1;
+        end = t1.size() - 2;
+        ret = 1;
+    }
+    unsigned int pin = getpin(t1,3,end);
+    if (pin == BADNUMBER) {
+        ERR("Failed to parse required pin state from "<<t1);
+        return 0;
+    } else if (pin == BADCMD) {
+        ERR("Not a valid command from "<<t1);
+        return 0;
+    }
+    if (value == UINT_MAX) {
+        // need second token
+        return compile_pin_bound(pin, t2, a);
+    }
+
+    a.run = run_digital;
+    a.pin = pin;
+    a.value = value;
+    return ret;
+}
+
+// adc channel N, value 0, 1 or ADC_STATS
+int compile_adc_value(unsigned int apin, unsigned int value, int ret, scratch_action &a)
+{
+    if ((apin >= 128) || (analog_pins[apin] == NO_ANALOG)) {
+        ERR("No such analog channel "<<apin);
+        return 0;
+    }
+    if ((value == ADC_STATS) && (apin >= ADC_WINDOW_CHANNELS)) {
+        ERR("No statistics for analog channel "<<apin);
+        return 0;
+    }
+    a.run = run_adc;
+    a.pin = apin;
+    a.value = value;
+    return ret;
+}
+
+// adcN value, or adcN on its own
+int compile_adc_bound(unsigned int apin, const std::string &t2, scratch_action &a)
+{
+    if (t2 == "off") {
+        return compile_adc_value(apin, 0, 2, a);
+    } else if (t2 == "on") {
+        return compile_adc_value(apin, 1, 2, a);
+    } else if (t2 == "stats") {
+        return compile_adc_value(apin, ADC_STATS, 2, a);
+    }
+    // assume command without parameters
+    return compile_adc_value(apin, 1, 1, a);
+}
+
+// enable reporting for ADC pin
+// adcN / adcNoff / adcNstats
+// p1=cmd p2=value
+// value absent = parse from number
+// pin provided is analog pin we must map to digital
+int compile_adc(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    unsigned int value = UINT_MAX;
+    int ret = 2;
+    size_t end = std::string::npos;
+    DBG("Parsing from "<<t1<<" "<<t2);
+    if (ends_in(t1,off)) {
+        value = 0;
+        end = t1.size() - 3;
+        ret = 1;
+    } else if ((t1.size() > 8) && ends_in(t1,stats)) {
+        value = ADC_STATS;
+        end = t1.size() - 5;
+        ret = 1;
+    }
+    unsigned int apin = getpin(t1,3,end);
+    if (apin == BADNUMBER) {
+        ERR("Failed to parse required pin state from "<<t1);
+        return 0;
+    } else if (apin == BADCMD) {
+        ERR("Not a valid command from "<<t1);
+        return 0;
+    }
+    if (value == UINT_MAX) {
+        // if no clue yet then try second arg
+        return compile_adc_bound(apin, t2, a);
+    }
+    return compile_adc_value(apin, value, ret, a);
+}
+
+// reporting period of an input or ADC in ms, 0 for the reporting interval
+// rateNN ms
+// rateadcNN ms
+int compile_rate(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    unsigned int pin;
+    DBG("Parsing from "<<t1<<" "<<t2);
+    if (t1.compare(4, 3, "adc") == 0) {
+        unsigned int apin = getpin(t1,7);
+        if ((apin >= 128) || (analog_pins[apin] == NO_ANALOG)) {
+            ERR("No such analog channel in "<<t1);
+            return 0;
+        }
+        pin = analog_pins[apin];
+    } else {
+        pin = getpin(t1,4);
+        if (pin >= 256) {
+            ERR("Failed to parse pin from "<<t1);
+            return 0;
+        }
+    }
+    if (!getvalue(t2, 0, REPORT_MAX_PERIOD_MS, a.value)) {
+        ERR("Failed to parse reporting period from "<<t2);
+        return 0;
+    }
+    a.run = run_rate;
+    a.pin = pin;
+    return 2;
+}
+
+// configNN value
+int compile_config_bound(unsigned int pin, const std::string &t2, scratch_action &a)
+{
+    if (t2 == "out") {
+        a.mode = MODE_OUTPUT;
+    } else if (t2 == "in") {
+        a.mode = MODE_INPUT;
+    } else if (t2 == "pu") {
+        a.mode = MODE_PULLUP;
+    } else {
+        ERR("Failed to parse required pin state from "<<t2);
+        return 0;
+    }
+    a.run = run_config;
+    a.pin = pin;
+    return 2;
+}
+
+// set ddr
+// config1in / config2 out
+// p1=cmd p2=value
+// value absent = parse from number
+int compile_config(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    unsigned int value = UINT_MAX;
+    int ret = 2;
+    size_t end = std::string::npos;
+    DBG("Parsing from "<<t1<<" "<<t2);
+    if (ends_in(t1,out)) {
+        value = MODE_OUTPUT;
+        end = t1.size() - 3;
+        ret = 1;
+    } else if (ends_in(t1,pu)) {
+        value = MODE_PULLUP;
+        end = t1.size() - 2;
+        ret = 1;
+    } else if (ends_in(t1,in)) {
+        value = MODE_INPUT;
+        end = t1.size() - 2;
+        ret = 1;
+    }
+    unsigned int pin = getpin(t1,6,end);
+    if (pin == BADNUMBER) {
+        ERR("Failed to parse required pin state from "<<t1);
+        return 0;
+    } else if (pin == BADCMD) {
+        ERR("Not a valid command from "<<t1);
+        return 0;
+    }
+    if (value == UINT_MAX) {
+        if (t2.empty()) {
+            ERR("Failed to parse required pin state from "<<t1);
+            return 0;
+        }
+        return compile_config_bound(pin, t2, a);
+    }
+    a.run = run_config;
+    a.pin = pin;
+    a.mode = value;
+    return ret;
+}
+
+// pwmNN val or servoNN val, raw, in the given mode
+int compile_analog_bound(unsigned int pin, uint8_t mode, const std::string &t2, scratch_action &a)
+{
+    if (!getvalue(t2, 0, INT32_MAX, a.value)) {
+        ERR("Failed to parse value from "<<t2);
+        return 0;
+    }
+    a.run = run_analog;
+    a.pin = pin;
+    a.mode = mode;
+    return 2;
+}
+
+// pwmNN val
+int compile_pwm_bound(unsigned int pin, const std::string &t2, scratch_action &a)
+{
+    return compile_analog_bound(pin, MODE_PWM, t2, a);
+}
+
+// servoNN val
+int compile_servo_bound(unsigned int pin, const std::string &t2, scratch_action &a)
+{
+    return compile_analog_bound(pin, MODE_SERVO, t2, a);
+}
+
+// set pwm value
+// pwmNN val
+// p1=number p2=value%
+int compile_pwm(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    DBG("Parsing from "<<t1<<" "<<t2);
+    unsigned int pin = getpin(t1,3);
+    if (pin == BADNUMBER) {
+        ERR("Failed to parse required pin state from "<<t1);
+        return 0;
+    } else if (pin == BADCMD) {
+        ERR("Not a valid command from "<<t1);
+        return 0;
+    }
+    return compile_pwm_bound(pin, t2, a);
+}
+
+// set servo value
+// servoNN val
+// p1=number p2=value%
+int compile_servo(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    DBG("Parsing from "<<t1<<" "<<t2);
+    unsigned int pin = getpin(t1,5);
+    if (pin == BADNUMBER) {
+        ERR("Failed to parse required pin state from "<<t1);
+        return 0;
+    } else if (pin == BADCMD) {
+        ERR("Not a valid command from "<<t1);
+        return 0;
+    }
+    return compile_servo_bound(pin, t2, a);
+}
+
+// motorNN val, % of the pin's range in the given mode
+int compile_percent_bound(unsigned int pin, uint8_t mode, const std::string &t2, scratch_action &a)
+{
+    int32_t percent;
+    if (!getvalue(t2, INT32_MIN, INT32_MAX, percent)) {
+        ERR("Failed to parse percentage from "<<t2);
+        return 0;
+    }
+    a.run = run_percent;
+    a.pin = pin;
+    a.mode = mode;
+    a.value = std::max(-100, std::min(100, percent));
+    return 2;
+}
+
+// motorNN val or powerNN val
+int compile_motor_bound(unsigned int pin, const std::string &t2, scratch_action &a)
+{
+    return compile_percent_bound(pin, MODE_PWM, t2, a);
+}
+
+int compile_pin_percent(const std::string &t1, const std::string &t2, size_t baseLen, uint8_t mode, scratch_action &a)
+{
+    DBG("Parsing from "<<t1<<" "<<t2);
+    unsigned int pin;
+    if (t1[baseLen] == 'a')
+    {
+        pin = 11;
+    }
+    else if (t1[baseLen] == 'b')
+    {
+        pin = 12;
+    }
+    else {
+        pin = getpin(t1,baseLen);
+        if (pin == BADNUMBER) {
+            ERR("Failed to parse required pin state from "<<t1);
+            return 0;
+        } else if (pin == BADCMD) {
+            ERR("Not a valid command from "<<t1);
+            return 0;
+        }
+    }
+    return compile_percent_bound(pin, mode, t2, a);
+}
+
+// motor speed - alias for pwm
+// motorA = motor11
+// motorB = motor12
+// motorNN val
+// p1=number p2=value
+int compile_motor(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    return compile_pin_percent(t1, t2, 5, MODE_PWM, a);
+}
+
+// power - alias for pwm
+// powerA = power11
+// powerB = power12
+// powerNN val
+// p1=number p2=value
+int compile_power(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    return compile_pin_percent(t1, t2, 5, MODE_PWM, a);
+}
+
+// set all pins
+// allpins value
+int compile_allpins(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    unsigned int value = UINT_MAX;
+    DBG("Parsing from "<<t1<<" "<<t2);
+    if ((t2 == "off") || (t2 == "low") || (t2 == "0")) {
+        value = 0;
+    } else if ((t2 == "on") || (t2 == "high") || (t2 == "1")) {
+        value = 1;
+    } else if (!t2.empty()) {
+        ERR("Failed to parse required pin state from "<<t2);
+        return 0;
+    }
+    a.run = run_allpins;
+    a.value = value;
+    a.priority = (value == 0);
+    return 2;
+}
+
+// set all pins on
+// allon
+int compile_allon(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    compile_allpins("allpins","on",a);
+    return 1;
+}
+
+// set all pins off
+// alloff
+int compile_alloff(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    compile_allpins("allpins","off",a);
+    return 1;
+}
+
+// motorname = custom name for motor
+// motorname % or motorname -% or motorname stop or motorname brake
+int compile_setmotor(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    std::map<std::string,tb6612fng>::iterator i = tb6612fng_list.find(t1);
+    if (i == tb6612fng_list.end())
+    {
+        ERR("Failed to find motor entry "<<t1);
+        return 0;
+    }
+    DBG("Setting motor "<<t1<<" to "<<t2);
+
+    a.motor = &i->second;
+    if (t2 == "stop")
+    {
+        a.run = run_motor_stop;
+        a.priority = true;
+    }
+    else if (t2 == "brake")
+    {
+        a.run = run_motor_brake;
+        a.priority = true;
+    }
+    else
+    {
+        int32_t speed;
+        if (!getvalue(t2, INT32_MIN, INT32_MAX, speed))
+        {
+            ERR("Failed to parse motor speed from "<<t2);
+            return 0;
+        }
+        a.run = run_motor_speed;
+        a.value = std::max(-100, std::min(100, speed));
+    }
+    return 2;
+}
+
+// groupname = custom name for a group of motors
+// groupname %,% or groupname % (all the same) or groupname stop or
+// groupname brake, each % may also be stop or brake
+int compile_setgroup(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    std::map<std::string,motor_group>::const_iterator i = motor_groups.find(t1);
+    if (i == motor_groups.end())
+    {
+        ERR("Failed to find motor group "<<t1);
+        return 0;
+    }
+    DBG("Setting motor group "<<t1<<" to "<<t2);
+
+    size_t count = i->second.motors.size();
+    size_t n = 0;
+    size_t start = 0;
+    a.priority = true;
+    while (start <= t2.size())
+    {
+        size_t end = t2.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = t2.size();
+        }
+        std::string token(t2.substr(start, end - start));
+        start = end + 1;
+        if (n >= count)
+        {
+            ERR("Too many speeds for motor group "<<t1<<" in "<<t2);
+            return 0;
+        }
+        int speed;
+        if (token == "stop")
+        {
+            speed = 0;
+        }
+        else if (token == "brake")
+        {
+            speed = GROUP_BRAKE;
+        }
+        else
+        {
+            int32_t value;
+            if (!getvalue(token, INT32_MIN, INT32_MAX, value))
+            {
+                ERR("Failed to parse motor speed from "<<token);
+                return 0;
+            }
+            speed = std::max(-100, std::min(100, value));
+            a.priority = false;
+        }
+        a.speeds[n++] = speed;
+    }
+    if (n == 1)
+    {
+        // one speed for all of them
+        std::fill(a.speeds + 1, a.speeds + count, a.speeds[0]);
+    }
+    else if (n != count)
+    {
+        ERR("Need "<<count<<" speeds for motor group "<<t1<<" in "<<t2);
+        return 0;
+    }
+    a.run = run_group;
+    a.group = &i->second;
+    return 2;
+}
+
+// macro name, runs the actions it was defined with
+std::map<std::string,action_list> macros;
+int compile_macro(const std::string &name, scratch_action &a)
+{
+    std::map<std::string,action_list>::const_iterator i = macros.find(name);
+    if (i == macros.end())
+    {
+        ERR("Failed to find macro "<<name);
+        return 0;
+    }
+    a.run = run_macro;
+    a.macro = &i->second;
+    return 1;
+}
+
+// check for custom commands
+int compile_custom(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    std::map<std::string,cmdfunc>::const_iterator i = custom_commands.find(t1);
+    if (i != custom_commands.end())
+    {
+        DBG("matched custom command "<<t1);
+        return i->second(t1,t2,a);
+    }
+    return 0;
+}
+
+// resolve a single request from scratch
+#define compile_thing(__x,__y,__z,__a) if (__x.find(#__y) == 0) return compile_##__y(__x,__z,__a)
+int compile_scratch(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    a = scratch_action();
+    int ret = compile_custom(t1,t2,a);
+    if (ret > 0)
+    {
+        return ret;
+    }
+    compile_thing(t1,pin,t2,a);
+    compile_thing(t1,adc,t2,a);
+    compile_thing(t1,rate,t2,a);
+    compile_thing(t1,config,t2,a);
+    compile_thing(t1,pwm,t2,a);
+    compile_thing(t1,servo,t2,a);
+    compile_thing(t1,allpins,t2,a);
+    compile_thing(t1,allon,t2,a);
+    compile_thing(t1,alloff,t2,a);
+    compile_thing(t1,motor,t2,a);
+    compile_thing(t1,power,t2,a);
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Definitions, these take effect as soon as they are received
+
+// define a motor controlled by a TB6612FNG
+// defmotor "motorname,pwmPin,in1Pin,in2Pin"
+int process_defmotor(const std::string &t1, const std::string &t2)
+{
+    DBG("t1 "<<t1<<" t2 "<<t2);
+    int j = 0;
+    std::string token;
+    std::string name;
+    unsigned int pwm = BADNUMBER, pin1 = BADNUMBER, pin2 = BADNUMBER;
+    size_t start = 0, end = 0;
+    while (end != std::string::npos) {
+        end = t2.find(',', start);
+        token.assign(t2.substr( start, (end == std::string::npos) ? std::string::npos : end - start));
+        start = ( end > (std::string::npos - 1)) ?  std::string::npos  :  (end + 1);
+        DBG("Token: " << token);
+        switch (j)
+        {
+            case 0: // motorname
+                name.assign(token);
+                DBG("Motor "<<name);
+                break;
+            case 1: // pwm pin
+                pwm = getpin(token, 0);
+                DBG("pwm "<<pwm);
+                break;
+            case 2: // pin1
+                pin1 = getpin(token, 0);
+                DBG("pin1 "<<pin1);
+                break;
+            case 3: // pin2
+                pin2 = getpin(token, 0);
+                DBG("pin2 "<<pin2);
+                break;
+        }
+        ++j;
+    }
+    if ((j != 4) || (pwm >= 256) || (pin1 >= 256) || (pin2 >= 256))
+    {
+        ERR("Failed to parse motor definition from "<<t2);
+        return 0;
+    }
+    tb6612fng_list[name].in1 = pin1;
+    tb6612fng_list[name].in2 = pin2;
+    tb6612fng_list[name].pwm = pwm;
+    DBG("Motor "<<pin1<<" "<<pin2<<" "<<pwm);
+    custom_commands[name] = compile_setmotor;
+    pinmode(pin1, MODE_OUTPUT);
+    pinmode(pin2, MODE_OUTPUT);
+    pinmode(pwm, MODE_PWM);
+    return 2;
+}
+
+// define a group of motors which are set together
+// defgroup "groupname,motorname1,motorname2..."
+int process_defgroup(const std::string &t1, const std::string &t2)
+{
+    DBG("t1 "<<t1<<" t2 "<<t2);
+    size_t comma = t2.find(',');
+    if ((comma == std::string::npos) || (comma == 0))
+    {
+        ERR("Failed to parse motor group definition from "<<t2);
+        return 0;
+    }
+    std::string name(t2.substr(0, comma));
+
+    motor_group g;
+    size_t start = comma + 1;
+    while (start <= t2.size())
+    {
+        size_t end = t2.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = t2.size();
+        }
+        std::string motor(t2.substr(start, end - start));
+        start = end + 1;
+        std::map<std::string,tb6612fng>::const_iterator i = tb6612fng_list.find(motor);
+        if (i == tb6612fng_list.end())
+        {
+            ERR("Failed to find motor entry "<<motor<<" for group "<<name);
+            return 0;
+        }
+        if (g.motors.size() >= MAX_GROUP_MOTORS)
+        {
+            ERR("Too many motors in group "<<name<<", most is "<<MAX_GROUP_MOTORS);
+            return 0;
+        }
+        g.motors.push_back(&i->second);
+    }
+    DBG("Motor group "<<name<<" has "<<g.motors.size()<<" motors");
+    motor_groups[name].motors.swap(g.motors);
+    custom_commands[name] = compile_setgroup;
+    return 2;
+}
+
+// "setmotor name x" and "setgroup name x" are the same as "name x"
+bool is_set_keyword(const std::string &t1)
+{
+    return (t1 == "setmotor") || (t1 == "setgroup");
+}
+
+// compile the space separated commands in cmds from start onwards
+// returns false if any of them are not understood
+bool compile_list(const std::string &name, const std::string &cmds, size_t start, action_list &actions)
+{
+    // split the commands on spaces
+    std::vector<std::string> tokens;
+    while (start < cmds.size())
+    {
+        size_t end = cmds.find(' ', start);
+        if (end == std::string::npos)
+        {
+            end = cmds.size();
+        }
+        if (end > start)
+        {
+            tokens.push_back(cmds.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    // dummy final token so that there is always a value to look at
+    tokens.push_back("");
+
+    size_t i = 0;
+    while (i + 1 < tokens.size())
+    {
+        if (is_set_keyword(tokens[i]))
+        {
+            ++i;
+            continue;
+        }
+        scratch_action a;
+        int k = compile_scratch(tokens[i], tokens[i+1], a);
+        if (k == 0)
+        {
+            ERR("Failed to parse "<<tokens[i]<<" in "<<name);
+            return false;
+        }
+        actions.push_back(a);
+        i += k;
+    }
+    return true;
+}
+
+// define a macro, a list of commands which are parsed once here and
+// then run together whenever the macro name is received
+// defmacro "name,cmd1 cmd2 ..."
+int process_defmacro(const std::string &t1, const std::string &t2)
+{
+    DBG("t1 "<<t1<<" t2 "<<t2);
+    size_t comma = t2.find(',');
+    if ((comma == std::string::npos) || (comma == 0))
+    {
+        ERR("Failed to parse macro definition from "<<t2);
+        return 0;
+    }
+    std::string name(t2.substr(0, comma));
+
+    action_list actions;
+    if (!compile_list(name, t2, comma + 1, actions))
+    {
+        return 0;
+    }
+    DBG("Macro "<<name<<" has "<<actions.size()<<" actions");
+    macros[name].swap(actions);
+    custom_commands[name] = [](const std::string &t1, const std::string &, scratch_action &a)
+    {
+        return compile_macro(t1, a);
+    };
+    return 2;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Reflexes, commands run by the daemon itself as soon as a sample from
+// the board meets a condition
+
+// time allowed between looking for samples while any reflex is defined
+#define REFLEX_POLL_US 500
+
+typedef struct
+{
+    std::string name;
+    reflex_condition cond;
+    uint8_t pin; // pin the condition depends on
+    action_list actions;
+} reflex_rule;
+std::vector<reflex_rule> reflexes;
+
+// reflex latency, from the sample arriving to the reaction being sent
+uint64_t reflex_count = 0;
+uint64_t reflex_total_ns = 0;
+uint64_t reflex_worst_ns = 0;
+
+// make sure the board is sending what the reflex needs
+void reflex_arm(reflex_rule &r)
+{
+    r.cond.met = false;
+    if (r.cond.kind == SAMPLE_ANALOG)
+    {
+        pinmode(r.pin, MODE_ANALOG);
+    }
+    else if (pins[r.pin].mode == MODE_PULLUP)
+    {
+        pinmode(r.pin, MODE_PULLUP);
+    }
+    else
+    {
+        pinmode(r.pin, MODE_INPUT);
+    }
+}
+
+// called once the board is connected
+void reflex_arm_all()
+{
+    std::vector<reflex_rule>::iterator i = reflexes.begin();
+    while (i != reflexes.end())
+    {
+        reflex_arm(*i);
+        ++i;
+    }
+}
+
+// define a reflex, the commands are run whenever the condition becomes
+// true, or remove it if no condition is given
+// reflex "name,condition,cmd1 cmd2 ..."
+// reflex "name"
+int process_reflex(const std::string &t1, const std::string &t2)
+{
+    DBG("t1 "<<t1<<" t2 "<<t2);
+    size_t comma1 = t2.find(',');
+    std::string name(t2.substr(0, comma1));
+    if (name.empty())
+    {
+        ERR("Failed to parse reflex definition from "<<t2);
+        return 0;
+    }
+
+    std::vector<reflex_rule>::iterator i = reflexes.begin();
+    while ((i != reflexes.end()) && (i->name != name))
+    {
+        ++i;
+    }
+    if (i != reflexes.end())
+    {
+        reflexes.erase(i);
+    }
+
+    if (comma1 != std::string::npos)
+    {
+        size_t comma2 = t2.find(',', comma1 + 1);
+        reflex_rule r;
+        r.name = name;
+        unsigned int pin;
+        if ((comma2 == std::string::npos) ||
+            (!reflex_parse(t2.substr(comma1 + 1, comma2 - comma1 - 1), r.cond, pin)))
+        {
+            ERR("Failed to parse reflex condition from "<<t2);
+            return 0;
+        }
+        if (r.cond.kind == SAMPLE_ANALOG)
+        {
+            if ((pin >= 128) || (analog_pins[pin] == NO_ANALOG))
+            {
+                ERR("No such analog channel "<<pin);
+                return 0;
+            }
+            r.pin = analog_pins[pin];
+        }
+        else
+        {
+            r.pin = pin;
+        }
+
+        if (!compile_list(name, t2, comma2 + 1, r.actions))
+        {
+            return 0;
+        }
+        if (r.actions.empty())
+        {
+            ERR("Failed to parse reflex commands from "<<t2);
+            return 0;
+        }
+        reflexes.push_back(r);
+        reflex_arm(reflexes.back());
+        DBG("Reflex "<<name<<" has "<<reflexes.back().actions.size()<<" actions");
+    }
+
+    board_poll_us = reflexes.empty() ? 0 : REFLEX_POLL_US;
+    return 2;
+}
+
+// run any reflexes triggered by a sample
+void reflex_sample(const link_sample &s)
+{
+    std::vector<reflex_rule>::iterator i = reflexes.begin();
+    while (i != reflexes.end())
+    {
+        if (reflex_check(i->cond, s))
+        {
+            scratch_action a = scratch_action();
+            a.run = run_macro;
+            a.macro = &i->actions;
+            a.priority = true;
+            try
+            {
+                run_action(a);
+            }
+            catch (const std::logic_error &e)
+            {
+                // as in dispatch_scratch_message(), a mistake in the
+                // commands rather than the link failing, keep the board
+                ERR("Reflex "<<i->name<<" failed, "<<e.what());
+                macro_depth = 0;
+                link_batch_unwind();
+            }
+
+            uint64_t latency = monotonic_ns() - s.t_ns;
+            ++reflex_count;
+            reflex_total_ns += latency;
+            reflex_worst_ns = std::max(reflex_worst_ns, latency);
+            DBG("Reflex "<<i->name<<" took "<<(latency / 1000)<<" us, mean "
+                <<(reflex_total_ns / reflex_count / 1000)<<" us, max "<<(reflex_worst_ns / 1000)<<" us");
+        }
+        ++i;
+    }
+}
+
+// how quickly reflexes reacted since the last report, then start again
+void reflex_report()
+{
+    if (reflex_count > 0)
+    {
+        std::cout << "reflex: " << reflex_count << " fired, latency mean "
+                  << (reflex_total_ns / reflex_count / 1000) << " us max "
+                  << (reflex_worst_ns / 1000) << " us" << std::endl;
+    }
+    reflex_count = 0;
+    reflex_total_ns = 0;
+    reflex_worst_ns = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Encoders
+
+void encoder_send(uint8_t cmd, uint8_t arg)
+{
+    std::vector<uint8_t> msg;
+    msg.push_back(FIRMATA_START_SYSEX);
+    msg.push_back(ENCODER_DATA);
+    msg.push_back(cmd);
+    msg.push_back(arg);
+    msg.push_back(FIRMATA_END_SYSEX);
+    firmlink->write(msg);
+}
+
+// attach encoder n on the board, the board sets the pin modes itself
+void encoder_attach(uint8_t n)
+{
+    encoder_info &e(encoders[n]);
+    uint8_t pin[2] = { e.pin_a, e.pin_b };
+    for (int p = 0; p < 2; ++p)
+    {
+        pins[pin[p]].mode = MODE_ENCODER;
+        pins[pin[p]].owned = true;
+        snapshot_mode(pin[p], MODE_ENCODER);
+        report_mode_changed(pin[p], MODE_ENCODER);
+    }
+    std::vector<uint8_t> msg;
+    msg.push_back(FIRMATA_START_SYSEX);
+    msg.push_back(ENCODER_DATA);
+    msg.push_back(ENCODER_ATTACH);
+    msg.push_back(n);
+    msg.push_back(e.pin_a);
+    msg.push_back(e.pin_b);
+    msg.push_back(FIRMATA_END_SYSEX);
+    firmlink->write(msg);
+    // the board starts counting from 0
+    e.t_ns = 0;
+    e.reported = 0;
+    e.reported_ns = 0;
+}
+
+// called once the board is connected
+void encoder_attach_all()
+{
+    for (size_t n = 0; n < encoders.size(); ++n)
+    {
+        encoder_attach(n);
+    }
+    if (!encoders.empty())
+    {
+        encoder_send(ENCODER_REPORT_AUTO, 1);
+    }
+}
+
+// pin is the encoder number
+void run_encoder_reset(const scratch_action &a)
+{
+    DBG("encoder "<<(int)a.pin<<" reset");
+    encoder_send(ENCODER_RESET_POSITION, a.pin);
+    encoders[a.pin].position = 0;
+    encoders[a.pin].reported = 0;
+    encoders[a.pin].reported_ns = encoders[a.pin].t_ns;
+}
+
+// encodername reset
+int compile_encoder(const std::string &t1, const std::string &t2, scratch_action &a)
+{
+    for (size_t n = 0; n < encoders.size(); ++n)
+    {
+        if (encoders[n].name == t1)
+        {
+            if (t2 != "reset")
+            {
+                ERR("Encoder "<<t1<<" can only be reset");
+                return 0;
+            }
+            a.run = run_encoder_reset;
+            a.pin = n;
+            return 2;
+        }
+    }
+    return 0;
+}
+
+// define a quadrature encoder counted by the board
+// defencoder "name,pinA,pinB"
+int process_defencoder(const std::string &t1, const std::string &t2)
+{
+    DBG("t1 "<<t1<<" t2 "<<t2);
+    size_t comma1 = t2.find(',');
+    size_t comma2 = (comma1 == std::string::npos) ? comma1 : t2.find(',', comma1 + 1);
+    if ((comma1 == 0) || (comma2 == std::string::npos))
+    {
+        ERR("Failed to parse encoder definition from "<<t2);
+        return 0;
+    }
+    std::string name(t2.substr(0, comma1));
+    unsigned int pin_a = getpin(t2, comma1 + 1, comma2);
+    unsigned int pin_b = getpin(t2, comma2 + 1);
+    if ((pin_a >= (unsigned int)numPins) || (pin_b >= (unsigned int)numPins) || (pin_a == pin_b))
+    {
+        ERR("Failed to parse encoder pins from "<<t2);
+        return 0;
+    }
+    size_t n = 0;
+    while ((n < encoders.size()) && (encoders[n].name != name))
+    {
+        ++n;
+    }
+    if (n == encoders.size())
+    {
+        if (n >= MAX_ENCODERS)
+        {
+            ERR("No more than "<<MAX_ENCODERS<<" encoders");
+            return 0;
+        }
+        encoders.push_back(encoder_info());
+        encoders[n].name = name;
+        encoders[n].label = scratch_label_intern(scratch_labels, name);
+        encoders[n].speed_label = scratch_label_intern(scratch_labels, name + "-speed");
+        custom_commands[name] = compile_encoder;
+    }
+    else
+    {
+        encoder_send(ENCODER_DETACH, n);
+    }
+    DBG("Encoder "<<name<<" is "<<n<<" on pins "<<pin_a<<","<<pin_b);
+    encoders[n].pin_a = pin_a;
+    encoders[n].pin_b = pin_b;
+    encoder_attach(n);
+    if (encoders.size() == 1)
+    {
+        encoder_send(ENCODER_REPORT_AUTO, 1);
+        encoder_schedule(monotonic_ns());
+    }
+    return 2;
+}
+
+// name a pin for one of the commands which apply to it, e.g.
+// defpin "leftled,pin13" then leftled on, or defpin "bumper,config4" then
+// bumper in, which is then reported as bumper rather than input4
+// defpin "name,cmdNN" (cmd is pin, adc, config, pwm, servo, motor or
+// power) or defpin "name,NN" for pinNN
+// the name is bound to the command's handler and the pin here, so using
+// it costs no more than the number
+int process_defpin(const std::string &t1, const std::string &t2)
+{
+    typedef struct
+    {
+        const char *cmd;
+        pinfunc bound;
+        bool adc; // the number is an analog channel
+    } pin_cmd;
+    static const pin_cmd cmds[] = {
+        { "pin", compile_pin_bound, false },
+        { "adc", compile_adc_bound, true },
+        { "config", compile_config_bound, false },
+        { "pwm", compile_pwm_bound, false },
+        { "servo", compile_servo_bound, false },
+        { "motor", compile_motor_bound, false },
+        { "power", compile_motor_bound, false },
+    };
+    DBG("t1 "<<t1<<" t2 "<<t2);
+    size_t comma = t2.find(',');
+    if ((comma == std::string::npos) || (comma == 0))
+    {
+        ERR("Failed to parse pin definition from "<<t2);
+        return 0;
+    }
+    std::string name(t2.substr(0, comma));
+    const pin_cmd *c = &cmds[0];
+    size_t ofs = comma + 1;
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i)
+    {
+        size_t len = strlen(cmds[i].cmd);
+        if (t2.compare(ofs, len, cmds[i].cmd) == 0)
+        {
+            c = &cmds[i];
+            ofs += len;
+            break;
+        }
+    }
+    unsigned int pin = getpin(t2, ofs);
+    bool adc = c->adc;
+    if ((!adc && (pin >= (unsigned int)numPins)) ||
+        (adc && ((pin >= 128) || (analog_pins[pin] == NO_ANALOG))))
+    {
+        ERR("Failed to parse pin from "<<t2);
+        return 0;
+    }
+    DBG("Pin "<<name<<" is "<<c->cmd<<" "<<pin);
+    custom_commands[name] = [c, pin](const std::string &, const std::string &t2, scratch_action &a)
+    {
+        return c->bound(pin, t2, a);
+    };
+
+    // only the pin last given the name is reported by it
+    std::replace(input_names, input_names + 256, name, std::string());
+    std::replace(adc_names, adc_names + 128, name, std::string());
+    uint8_t report_pin = pin;
+    if (adc)
+    {
+        adc_names[pin] = name;
+        report_pin = analog_pins[pin];
+    }
+    else
+    {
+        input_names[pin] = name;
+    }
+    // already being reported, under the old name
+    int16_t slot = report_slot[report_pin];
+    if (slot != NO_REPORT)
+    {
+        report_entry &e(reports[slot - 1]);
+        if (adc && (e.kind != REPORT_INPUT))
+        {
+            e.label = adc_label(pin, e.kind == REPORT_ADC_STATS);
+        }
+        else if (!adc && (e.kind == REPORT_INPUT))
+        {
+            e.label = input_label(pin);
+        }
+        e.last = UINT32_MAX;
+    }
+    return 2;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Handling data from firmata
+
+// deal with every sample the board has sent since the last parse
+void process_samples()
+{
+    if (snapshot != nullptr)
+    {
+        // before anything which might throw part way through
+        snapshot_samples(firmlink->samples);
+    }
+    std::vector<link_sample>::const_iterator i = firmlink->samples.begin();
+    while (i != firmlink->samples.end())
+    {
+        if (capture_hdr != nullptr)
+        {
+            capture_write(i->t_ns, i->kind, i->index, i->value);
+        }
+        if ((i->kind == SAMPLE_ANALOG) && (i->index < ADC_WINDOW_CHANNELS))
+        {
+            adc_window_fold(adc_windows[i->index], i->value);
+        }
+        else if ((i->kind == SAMPLE_ENCODER) && (i->index < encoders.size()))
+        {
+            encoders[i->index].position = i->value;
+            encoders[i->index].t_ns = i->t_ns;
+        }
+        reflex_sample(*i);
+        ++i;
+    }
+    firmlink->samples.clear();
+
+    if ((mux != nullptr) && (!firmlink->replies.empty()))
+    {
+        mux->send(firmlink->replies);
+        firmlink->replies.clear();
+    }
+
+    // whatever each serial port received this time goes in one write
+    uint16_t ports = firmlink->serial_ports;
+    for (int port = 0; ports != 0; ++port, ports >>= 1)
+    {
+        if ((ports & 1) && (serial_ptys != nullptr))
+        {
+            serial_ptys->send(port, firmlink->serial[port], firmlink->serial_ns[port]);
+        }
+        firmlink->serial[port].clear();
+    }
+    firmlink->serial_ports = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Board serial ports on ptys, see serialpty.h
+
+#ifndef MODE_SERIAL
+#define MODE_SERIAL 0x0a
+#endif
+
+// set up every serial port and start it reporting, on connecting
+void serial_setup()
+{
+    if (serial_ptys == nullptr)
+    {
+        return;
+    }
+    // the board sets the pin modes itself, keep scratch and mux
+    // clients off the pins of software serial ports
+    std::vector<uint8_t> used;
+    serial_ptys->pins(used);
+    std::vector<uint8_t>::const_iterator p = used.begin();
+    while (p != used.end())
+    {
+        pins[*p].mode = MODE_SERIAL;
+        pins[*p].owned = true;
+        snapshot_mode(*p, MODE_SERIAL);
+        ++p;
+    }
+    std::vector<std::vector<uint8_t> > msgs;
+    serial_ptys->config(msgs);
+    std::vector<std::vector<uint8_t> >::const_iterator i = msgs.begin();
+    while (i != msgs.end())
+    {
+        firmlink->write(*i);
+        ++i;
+    }
+}
+
+// host wrote to a serial port's pty
+std::vector<uint8_t> serial_msg;
+void serial_to_board(uint8_t port, const uint8_t *data, size_t size)
+{
+    if (firmlink == nullptr)
+    {
+        return;
+    }
+    serial_write_msg(serial_msg, port, data, size);
+    firmlink->write(serial_msg);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Raw Firmata from mux clients, see firmmux.h
+
+// any pin in the port set up by the daemon, as a port bit mask
+uint8_t owned_port_mask(uint8_t port)
+{
+    uint8_t mask = 0;
+    for (int bit = 0; bit < 8; ++bit)
+    {
+        if (pins[(port * 8) + bit].owned)
+        {
+            mask |= (1 << bit);
+        }
+    }
+    return mask;
+}
+
+// pass a message from a mux client on to the board unless it would
+// change something the daemon is using
+const char *mux_message(std::string &msg)
+{
+    if (!connected_to_firmata())
+    {
+        return "board not connected";
+    }
+    uint8_t cmd = msg[0];
+    int pin = -1;
+    switch (cmd & 0xf0)
+    {
+        case FIRMATA_DIGITAL_MESSAGE:
+        {
+            // sets the whole port, only the pins the daemon is not using
+            // are the client's, and the daemon's own port writes keep
+            // them as the client left them
+            uint8_t port = cmd & 0x0f;
+            uint8_t value = (msg[1] & 0x7f) | ((msg[2] & 0x01) << 7);
+            firmlink->writePort(port, value, ~owned_port_mask(port));
+            return nullptr;
+        }
+        case FIRMATA_ANALOG_MESSAGE:
+            pin = cmd & 0x0f;
+            break;
+        case FIRMATA_REPORT_ANALOG:
+            // turning reporting on is harmless, turning it off is not
+            if ((msg[1] == 0) && (analog_pins[cmd & 0x0f] != NO_ANALOG))
+            {
+                pin = analog_pins[cmd & 0x0f];
+            }
+            break;
+        case FIRMATA_REPORT_DIGITAL:
+            if ((msg[1] == 0) && (owned_port_mask(cmd & 0x0f) != 0))
+            {
+                return "port in use by scratch";
+            }
+            break;
+        default:
+            switch (cmd)
+            {
+                case FIRMATA_SET_PIN_MODE:
+                case FIRMATA_SET_DIGITAL_PIN_VALUE:
+                    pin = msg[1];
+                    break;
+                case FIRMATA_SYSTEM_RESET:
+                    return "reset not allowed";
+                case FIRMATA_START_SYSEX:
+                    if (msg.size() < 3)
+                    {
+                        break;
+                    }
+                    // extended analog and servo config name a pin,
+                    // sampling interval is the daemon's to set
+                    if ((msg[1] == 0x6f) || (msg[1] == 0x70))
+                    {
+                        pin = msg[2];
+                    }
+                    else if (msg[1] == 0x7a)
+                    {
+                        return "sampling interval in use by scratch";
+                    }
+                    else if ((msg[1] == ENCODER_DATA) && (!encoders.empty()))
+                    {
+                        return "encoders in use by scratch";
+                    }
+                    break;
+            }
+            break;
+    }
+    if ((pin >= 0) && pins[pin].owned)
+    {
+        DBG("refused mux message for pin "<<pin);
+        return "pin in use by scratch";
+    }
+    if ((cmd == FIRMATA_SET_PIN_MODE) && (pin < numPins))
+    {
+        // keep track so that pinmode() does not think it is already set
+        pins[pin].mode = msg[2];
+        snapshot_mode(pin, msg[2]);
+    }
+    firmlink->write(std::vector<uint8_t>(msg.begin(), msg.end()));
+    return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Messages from scratch
+
+// process a single request from scratch
+#define process_thing(__x,__y,__z) if (__x.find(#__y) == 0) return process_##__y(__x,__z)
+int process_scratch(const std::string &t1, const std::string &t2 = "")
+{
+    DBG("t1 "<<t1<<" t2 "<<t2);
+    if (is_set_keyword(t1))
+    {
+        return 1;
+    }
+    scratch_action a;
+    int ret = compile_scratch(t1,t2,a);
+    if (ret > 0)
+    {
+        run_action(a);
+        return ret;
+    }
+    process_thing(t1,defmotor,t2);
+    process_thing(t1,defgroup,t2);
+    process_thing(t1,defmacro,t2);
+    process_thing(t1,reflex,t2);
+    process_thing(t1,defencoder,t2);
+    process_thing(t1,defpin,t2);
+    return 0;
+}
+
+// process one message from scratch
+void dispatch_scratch_message(const unsigned char *msgbuf, unsigned int msglen)
+{
+    // msg format is
+    // msgtype "label" [value]
+    // msgtype generally == broadcast
+    // label can be a quoted list of pins to process (e.g. pin1on pin2off)
+    // or can be a single name with value as a separate arg
+    int i;
+    DBG("msg is '"<<std::string((const char *)msgbuf, msglen)<<"'");
+    std::string token;
+    i = 0;
+    int j = 0;
+    bool in_quotes = false;
+    bool multivalue = false;
+    std::vector <std::string> tokens;
+    // broadcast message requires splitting on space within spaces
+    bool broadcast = false ; // assume sensor-update for now
+    
+    while (i < msglen)
+    {
+        //DBG("char "<<i<<" = \""<<msgbuf[i]<<"\"");
+        if (msgbuf[i] == ' ')
+        {
+            if (in_quotes)
+            {
+                if (broadcast)
+                {
+                    // space within quotes in a broadcast message has to be
+                    // split to a new token
+                    std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+                    tokens.push_back(token);
+                    token.clear();
+                    ++j;
+                } else {
+                    // otherwise we preserve the whitespace within the token
+                    token.append(1, msgbuf[i]);
+                }
+            } else {
+                // outside quotes, space means move to next token
+                DBG("token "<<j<<" is \""<<token<<"\"");
+                std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+                if (j == 0) {
+                    // message type, broadcast or sensor-update
+                    if (token == "broadcast") {
+                        broadcast = true;
+                        DBG("Is broadcast");
+                    } else if (token != "sensor-update") {
+                        ERR("Failed to find message type in "<<token);
+                        break;
+                    }
+                }
+                tokens.push_back(token);
+                token.clear();
+                ++j;
+            }
+        } else if (msgbuf[i] == '"') {
+            // ditch the quotes but record the status
+            if (in_quotes)
+            {
+                // already in quotes
+                in_quotes = false;
+            } else {
+                in_quotes = true;
+            }
+        } else {
+            // normal character, add to buffer
+            token.append(1, msgbuf[i]);
+        }
+        ++i;
+    }
+
+    // preserve any final token
+    if (!token.empty()) {
+        std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+        tokens.push_back(token);
+        token.clear();
+        ++j;
+    }
+
+    // dispatch the tokens
+    // add a dummy extra token to the end of the tokens so that we can always find
+    // an extra empty token to reference when we reach the end
+    tokens.push_back("");
+    if (board_state != BOARD_READY)
+    {
+        // nothing can reach the board yet
+        board_journal_tokens(broadcast, tokens);
+        return;
+    }
+    i=1;
+    int k = 0;
+    startup_phase(STARTUP_COMMAND, "first command");
+    link_batch_begin();
+    try
+    {
+        while (i < j) {
+            DBG("Processing token "<<tokens[i]);
+            if (broadcast && ((tokens[i] == "defmacro") || (tokens[i] == "reflex"))) {
+                // the rest of the broadcast is the definition
+                std::string body;
+                for (k = i + 1; k < j; ++k) {
+                    if (k > i + 1) { body.append(1, ' '); }
+                    body.append(tokens[k]);
+                }
+                process_scratch(tokens[i], body);
+                break;
+            }
+            k = process_scratch(tokens[i],tokens[i+1]);
+            if (k == 0) {
+                ERR("Failed to parse token "<<i<<" "<<tokens[i]);
+                // failed to parse the command
+                // for a broadcast, skip one token, for sensor-update skip 2
+                if (broadcast) { k = 1; } else { k = 2; }
+            }
+            DBG("Consuming "<<k<<" tokens");
+            i+=k;
+        }
+    }
+    catch (const std::logic_error &e)
+    {
+        // parsing commands does not throw, so this is a mistake in
+        // carrying one out rather than the link failing, which would
+        // be dropped and connected again for nothing
+        ERR("Failed to carry out "<<tokens[i]<<", "<<e.what());
+        macro_depth = 0;
+        link_batch_unwind();
+        return;
+    }
+    catch (...)
+    {
+        link_batch_abort();
+        throw;
+    }
+    link_batch_end();
+}
+
+// read exactly len bytes, returns false if the connection failed
+// most time to wait for the rest of a message from scratch
+#define SCRATCH_READ_TIMEOUT_MS 1000
+bool read_fully(int fd, unsigned char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0)
+        {
+            if ((n < 0) && (errno == EINTR))
+            {
+                continue;
+            }
+            if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+            {
+                // the socket does not block, the rest is on its way
+                struct pollfd p = { fd, POLLIN, 0 };
+                if (poll(&p, 1, SCRATCH_READ_TIMEOUT_MS) > 0)
+                {
+                    continue;
+                }
+                errno = ETIMEDOUT;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// session recording, every message from scratch with the time it arrived
+FILE *record_file = nullptr;
+uint64_t record_start;
+#define RECORD_MAGIC "SCRREC1\n"
+
+bool record_open(const std::string &path)
+{
+    record_file = fopen(path.c_str(), "wb");
+    if (record_file == nullptr)
+    {
+        std::cerr << "Failed to open recording "<<path<<", "<<strerror(errno)<<std::endl;
+        return false;
+    }
+    fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), record_file);
+    fflush(record_file);
+    record_start = monotonic_ns();
+    return true;
+}
+
+// each frame is stored as ns since start, length and the message itself
+void record_frame(const unsigned char *msgbuf, uint32_t msglen)
+{
+    uint64_t t = monotonic_ns() - record_start;
+    fwrite(&t, sizeof(t), 1, record_file);
+    fwrite(&msglen, sizeof(msglen), 1, record_file);
+    fwrite(msgbuf, 1, msglen, record_file);
+    fflush(record_file);
+}
+
+std::vector<unsigned char> scratch_in;
+void read_scratch_message()
+{
+    // msg format is
+    // XXXX:msgtype "label" [value]
+    unsigned char c[4];
+
+    if (!read_fully(scratch_fd, c, 4))
+    {
+        // something bad happened
+        ERR("failed to read from scratch, "<<strerror(errno));
+        disconnect_scratch();
+        return;
+    }
+
+    unsigned int msglen = (c[0]*16777216) + (c[1]*65536) + (c[2]*256) + c[3];
+    DBG("msglen is "<<msglen);
+
+    scratch_in.resize(msglen + 1);
+    if (!read_fully(scratch_fd, &scratch_in[0], msglen))
+    {
+        ERR("failed to read from scratch, "<<strerror(errno));
+        disconnect_scratch();
+        return;
+    }
+    scratch_in[msglen]=0;
+
+    if (record_file != nullptr)
+    {
+        record_frame(&scratch_in[0], msglen);
+    }
+    dispatch_scratch_message(&scratch_in[0], msglen);
+}
+
+// a message from a websocket client, same format as from scratch
+void dispatch_ws_message(const std::string &msg)
+{
+    if (record_file != nullptr)
+    {
+        record_frame((const unsigned char *)msg.data(), msg.size());
+    }
+    dispatch_scratch_message((const unsigned char *)msg.data(), msg.size());
+}
+
+// feed a recorded session back through the dispatcher
+// speed 1 = as recorded, 2 = twice as fast, 0 = as fast as possible
+int replay_scratch(int conntype, const std::string &port, const std::string &path, double speed)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr)
+    {
+        std::cerr << "Failed to open recording "<<path<<", "<<strerror(errno)<<std::endl;
+        return 1;
+    }
+    char magic[sizeof(RECORD_MAGIC)] = "";
+    if ((fread(magic, 1, strlen(RECORD_MAGIC), fp) != strlen(RECORD_MAGIC)) ||
+        (strcmp(magic, RECORD_MAGIC) != 0))
+    {
+        std::cerr << path<<" is not a scratch recording"<<std::endl;
+        fclose(fp);
+        return 1;
+    }
+
+    if (!connect_firmata(conntype, port))
+    {
+        fclose(fp);
+        return 1;
+    }
+
+    uint64_t frames = 0;
+    uint64_t busy = 0;
+    uint64_t worst = 0;
+    uint64_t t;
+    uint32_t msglen;
+    std::vector<unsigned char> msgbuf;
+    uint64_t start = monotonic_ns();
+    while ((!stopping) &&
+           (fread(&t, sizeof(t), 1, fp) == 1) &&
+           (fread(&msglen, sizeof(msglen), 1, fp) == 1))
+    {
+        msgbuf.resize(msglen + 1);
+        if (fread(&msgbuf[0], 1, msglen, fp) != msglen)
+        {
+            break;
+        }
+        msgbuf[msglen] = 0;
+
+        if (speed > 0)
+        {
+            // wait until the message is due, keeping up with the board
+            uint64_t due = start + (uint64_t)(t / speed);
+            while (monotonic_ns() < due)
+            {
+                f->parse();
+                process_samples();
+                usleep(std::min<uint64_t>((due - monotonic_ns()) / 1000, 1000));
+            }
+        }
+
+        uint64_t before = monotonic_ns();
+        try
+        {
+            f->parse();
+            process_samples();
+            before = monotonic_ns();
+            dispatch_scratch_message(&msgbuf[0], msglen);
+        }
+        catch (...)
+        {
+            ERR("Failed to replay message "<<frames);
+            if (!connected_to_firmata())
+            {
+                break;
+            }
+        }
+        uint64_t took = monotonic_ns() - before;
+        busy += took;
+        worst = std::max(worst, took);
+        ++frames;
+    }
+    uint64_t elapsed = monotonic_ns() - start;
+    fclose(fp);
+
+    std::cout << "Replayed "<<frames<<" messages in "<<(elapsed / 1e6)<<" ms";
+    if (frames > 0)
+    {
+        std::cout << ", "<<(frames * 1e9 / elapsed)<<" msgs/s"
+                  << ", dispatch mean "<<(busy / frames)<<" ns max "<<worst<<" ns";
+    }
+    std::cout << std::endl;
+    link_report(firmlink);
+    reflex_report();
+    disconnect_firmata();
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Sending data to scratch
+
+// length of the framed message at pos
+inline size_t scratch_frame_size(const std::string &buf, size_t pos)
+{
+    const unsigned char *p = (const unsigned char *)buf.data() + pos;
+    return 4 + ((size_t)p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+}
+
+// next token of a message body from pos, a quoted string (with "" for
+// a quote) or up to the next space, returns its end
+size_t scratch_token_end(const std::string &buf, size_t pos, size_t end)
+{
+    if (buf[pos] != '"')
+    {
+        size_t space = buf.find(' ', pos);
+        return ((space == std::string::npos) || (space > end)) ? end : space;
+    }
+    ++pos;
+    while (pos < end)
+    {
+        if (buf[pos++] == '"')
+        {
+            if ((pos < end) && (buf[pos] == '"'))
+            {
+                ++pos;
+                continue;
+            }
+            break;
+        }
+    }
+    return pos;
+}
+
+// keep only the newest value for each label in the sensor updates
+// waiting for scratch, everything else stays as and where it was
+void scratch_conflate()
+{
+    static const std::string update("sensor-update");
+    std::vector<std::pair<size_t, size_t> > msgs; // start, size
+    size_t pos = scratch_partial;
+    while (pos < scratch_pending.size())
+    {
+        size_t size = scratch_frame_size(scratch_pending, pos);
+        msgs.push_back(std::make_pair(pos, size));
+        pos += size;
+    }
+
+    // newest first, so the first value seen for a label is the one kept
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> rebuilt(msgs.size());
+    for (size_t m = msgs.size(); m-- > 0; )
+    {
+        size_t start = msgs[m].first + 4;
+        size_t end = msgs[m].first + msgs[m].second;
+        if (scratch_pending.compare(start, update.size(), update) != 0)
+        {
+            rebuilt[m].assign(scratch_pending, msgs[m].first, msgs[m].second);
+            continue;
+        }
+        scratch_msg_begin(rebuilt[m], "sensor-update");
+        bool any = false;
+        pos = start + update.size();
+        while (pos < end)
+        {
+            while ((pos < end) && (scratch_pending[pos] == ' '))
+            {
+                ++pos;
+            }
+            if (pos >= end)
+            {
+                break;
+            }
+            size_t label_end = scratch_token_end(scratch_pending, pos, end);
+            size_t value = label_end;
+            while ((value < end) && (scratch_pending[value] == ' '))
+            {
+                ++value;
+            }
+            size_t value_end = (value < end) ? scratch_token_end(scratch_pending, value, end) : end;
+            if (seen.insert(scratch_pending.substr(pos, label_end - pos)).second)
+            {
+                rebuilt[m].append(1, ' ');
+                rebuilt[m].append(scratch_pending, pos, value_end - pos);
+                any = true;
+            }
+            else
+            {
+                ++scratch_conflated;
+            }
+            pos = value_end;
+        }
+        if (any)
+        {
+            scratch_msg_end(rebuilt[m]);
+        }
+        else
+        {
+            rebuilt[m].clear();
+        }
+    }
+
+    scratch_pending.resize(scratch_partial);
+    std::vector<std::string>::const_iterator i = rebuilt.begin();
+    while (i != rebuilt.end())
+    {
+        scratch_pending.append(*i);
+        ++i;
+    }
+    DBG("conflated scratch output to "<<scratch_pending.size()<<" bytes");
+}
+
+// take written bytes off the front of scratch_pending
+void scratch_consume(size_t n)
+{
+    size_t pos = 0;
+    size_t size = (scratch_partial > 0) ? scratch_partial : scratch_frame_size(scratch_pending, 0);
+    while (pos + size <= n)
+    {
+        pos += size;
+        size = (pos < scratch_pending.size()) ? scratch_frame_size(scratch_pending, pos) : 0;
+        if (size == 0)
+        {
+            break;
+        }
+    }
+    scratch_partial = (pos < n) ? (size - (n - pos)) : 0;
+    scratch_pending.erase(0, n);
+    if (scratch_pending.empty())
+    {
+        scratch_conflate_at = SCRATCH_HIGH_WATER;
+    }
+}
+
+// send what is waiting as far as the socket allows, false if scratch
+// has gone
+bool scratch_flush()
+{
+    while (!scratch_pending.empty())
+    {
+        ssize_t n = write(scratch_fd, scratch_pending.data(), scratch_pending.size());
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+        }
+        scratch_consume(n);
+    }
+    return true;
+}
+
+// send the message built in scratch_out, or queue it behind anything
+// still waiting, so that a stalled scratch never stops the main loop
+void write_to_scratch()
+{
+    DBG("writing: "<<scratch_out.substr(4));
+    bool ok = true;
+    if (scratch_pending.empty())
+    {
+        ssize_t n = write(scratch_fd, scratch_out.data(), scratch_out.size());
+        if (n == (ssize_t)scratch_out.size())
+        {
+            return;
+        }
+        if (n < 0)
+        {
+            ok = ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR));
+            n = 0;
+        }
+        scratch_pending.assign(scratch_out, n, std::string::npos);
+        scratch_partial = (n > 0) ? scratch_pending.size() : 0;
+    }
+    else
+    {
+        scratch_pending.append(scratch_out);
+        if (scratch_pending.size() > scratch_conflate_at)
+        {
+            scratch_conflate();
+            // until it has doubled again, so conflating stays cheap
+            scratch_conflate_at = std::max((size_t)SCRATCH_HIGH_WATER, scratch_pending.size() * 2);
+        }
+        if (scratch_pending.size() > SCRATCH_MAX_PENDING)
+        {
+            disconnect_scratch();
+            ERR("Scratch is not reading, disconnected");
+            return;
+        }
+    }
+    ++scratch_queued;
+    scratch_max_pending = std::max(scratch_max_pending, scratch_pending.size());
+    if (!ok)
+    {
+        // disconnect first so the error is not reported back to scratch
+        disconnect_scratch();
+        ERR("Failed to write message to scratch");
+    }
+}
+
+void write_scratch_message(const std::string &msgtype, const std::string &label, const std::string &value)
+{
+    if (ws != nullptr)
+    {
+        // {"label":"value"} or {"broadcast":"label"}
+        ws_out.assign(1, '{');
+        if (msgtype == "sensor-update") {
+            ws_json_append_string(ws_out, label);
+            ws_out.append(1, ':');
+            ws_json_append_string(ws_out, value);
+        } else {
+            ws_json_append_string(ws_out, msgtype);
+            ws_out.append(1, ':');
+            ws_json_append_string(ws_out, label);
         }
-        ++j;
+        ws_out.append(1, '}');
+        DBG("sending: "<<ws_out);
+        ws->send(ws_out);
     }
-    if (j != 4)
+    if (scratch_fd < 0)
     {
-        ERR("Failed to parse motor definition from "<<t2);
-        return 0;
+        return;
     }
-    tb6612fng_list[name].in1 = pin1;
-    tb6612fng_list[name].in2 = pin2;
-    tb6612fng_list[name].pwm = pwm;
-    DBG("Motor "<<pin1<<" "<<pin2<<" "<<pwm);
-    custom_commands[name] = process_setmotor;
-    pinmode(pin1, MODE_OUTPUT);
-    pinmode(pin2, MODE_OUTPUT);
-    pinmode(pwm, MODE_PWM);
-    return 2;
+    scratch_msg_begin(scratch_out, msgtype.c_str());
+    scratch_msg_append_quoted(scratch_out, label);
+    if (msgtype == "sensor-update") {
+        scratch_msg_append_quoted(scratch_out, value);
+    }
+    scratch_msg_end(scratch_out);
+    write_to_scratch();
 }
 
-// check for custom commands
-int process_custom(const std::string &t1, const std::string &t2 = "")
+// add an interned label to the websocket frame, escaped for JSON as
+// defpin and defencoder names may hold anything scratch sent
+void ws_append_label(uint16_t label)
 {
-    std::map<std::string,cmdfunc>::const_iterator i = custom_commands.find(t1);
-    if (i != custom_commands.end())
+    while (ws_labels.size() <= label)
     {
-        return i->second(t1,t2);
-        return true;
+        // the interned label is ' "name"'
+        const std::string &quoted(scratch_labels.quoted[ws_labels.size()]);
+        std::string json;
+        ws_json_append_string(json, quoted.substr(2, quoted.size() - 3));
+        json.append(1, ':');
+        ws_labels.push_back(json);
     }
-    return 0;
+    ws_out.append(ws_labels[label]);
 }
 
-// process a single request from scratch
-#define process_thing(__x,__y,__z) if (__x.find(#__y) == 0) return process_##__y(__x,__z)
-int process_scratch(const std::string &t1, const std::string &t2 = "")
+// add a label and signed value to the messages being built by
+// write_reports
+void report_append_signed(uint16_t label, int32_t value)
 {
-    DBG("t1 "<<t1<<" t2 "<<t2);
-    int ret = process_custom(t1,t2);
-    if (ret > 0)
+    if (ws != nullptr)
     {
-        DBG("matched custom command "<<t1);
-        return ret;
+        if (ws_out.size() > 1)
+        {
+            ws_out.append(1, ',');
+        }
+        ws_append_label(label);
+        scratch_msg_append_int(ws_out, value);
+    }
+    if (scratch_fd >= 0)
+    {
+        scratch_msg_append_label(scratch_out, scratch_labels, label);
+        scratch_out.append(1, ' ');
+        scratch_msg_append_int(scratch_out, value);
     }
-    process_thing(t1,pin,t2);
-    process_thing(t1,adc,t2);
-    process_thing(t1,config,t2);
-    process_thing(t1,pwm,t2);
-    process_thing(t1,servo,t2);
-    process_thing(t1,allpins,t2);
-    process_thing(t1,allon,t2);
-    process_thing(t1,alloff,t2);
-    process_thing(t1,motor,t2);
-    process_thing(t1,power,t2);
-    process_thing(t1,defmotor,t2);
-    return 0;
 }
 
-void read_scratch_message()
+// add a label and value to the messages being built by write_reports
+void report_append(uint16_t label, uint32_t value)
 {
-    // msg format is
-    // XXXX:msgtype "label" [value]
-    // msgtype generally == broadcast
-    // label can be a quoted list of pins to process (e.g. pin1on pin2off)
-    // or can be a single name with value as a separate arg
-    int i;
-    unsigned char c[4];
-
-    if (read(scratch_fd,&c,4) != 4)
+    if (ws != nullptr)
     {
-        // something bad happened
-        ERR("failed to read from scratch, "<<strerror(errno));
-        disconnect_scratch();
-        return;
+        if (ws_out.size() > 1)
+        {
+            ws_out.append(1, ',');
+        }
+        ws_append_label(label);
+        scratch_msg_append_uint(ws_out, value);
     }
+    if (scratch_fd >= 0)
+    {
+        scratch_msg_append_label(scratch_out, scratch_labels, label);
+        scratch_msg_append_value(scratch_out, value);
+    }
+}
 
-    unsigned int msglen = (c[0]*16777216) + (c[1]*65536) + (c[2]*256) + c[3];
-    DBG("msglen is "<<msglen);
-
-    unsigned char * msgbuf = (unsigned char *)malloc(msglen+1);
-    if (read(scratch_fd, msgbuf, msglen) != msglen)
+// send the listed report entries, and the encoders if with_encoders, to
+// scratch as one sensor-update with a label and value for each,
+// websocket clients get them all in one frame, {"adc0":123,"input4":1}
+std::vector<uint16_t> report_list;
+void write_reports(const std::vector<uint16_t> &list, bool with_encoders)
+{
+    if (list.empty() && (!with_encoders))
     {
-        ERR("failed to read from scratch, "<<strerror(errno));
-        free(msgbuf);
-        disconnect_scratch();
         return;
     }
-    msgbuf[msglen]=0;
-
-    DBG("msg is '"<<msgbuf<<"'");
-    std::string token;
-    i = 0;
-    int j = 0;
-    bool in_quotes = false;
-    bool multivalue = false;
-    std::vector <std::string> tokens;
-    // broadcast message requires splitting on space within spaces
-    bool broadcast = false ; // assume sensor-update for now
-    
-    while (i < msglen)
+    if (ws != nullptr)
     {
-        //DBG("char "<<i<<" = \""<<msgbuf[i]<<"\"");
-        if (msgbuf[i] == ' ')
+        ws_out.assign(1, '{');
+    }
+    if (scratch_fd >= 0)
+    {
+        scratch_msg_begin(scratch_out, "sensor-update");
+    }
+    std::vector<uint16_t>::const_iterator i = list.begin();
+    while (i != list.end())
+    {
+        report_entry &e(reports[*i]);
+        switch (e.kind)
         {
-            if (in_quotes)
+            case REPORT_ADC:
+            case REPORT_ADC_STATS:
+                e.last = f->analogRead(e.pin);
+                break;
+            case REPORT_INPUT:
+                e.last = f->digitalRead(e.pin);
+                break;
+        }
+        report_append(e.label, e.last);
+        if (e.kind == REPORT_ADC_STATS)
+        {
+            // nothing is sent for a window with no samples in it
+            uint8_t apin = pins[e.pin].analog;
+            uint32_t results[ADC_RESULTS];
+            if ((apin < ADC_WINDOW_CHANNELS) && adc_window_take(adc_windows[apin], results))
             {
-                if (broadcast)
+                for (int r = 0; r < ADC_RESULTS; ++r)
                 {
-                    // space within quotes in a broadcast message has to be
-                    // split to a new token
-                    std::transform(token.begin(), token.end(), token.begin(), ::tolower);
-                    tokens.push_back(token);
-                    token.clear();
-                    ++j;
-                } else {
-                    // otherwise we preserve the whitespace within the token
-                    token.append(1, msgbuf[i]);
-                }
-            } else {
-                // outside quotes, space means move to next token
-                DBG("token "<<j<<" is \""<<token<<"\"");
-                std::transform(token.begin(), token.end(), token.begin(), ::tolower);
-                if (j == 0) {
-                    // message type, broadcast or sensor-update
-                    if (token == "broadcast") {
-                        broadcast = true;
-                        DBG("Is broadcast");
-                    } else if (token != "sensor-update") {
-                        ERR("Failed to find message type in "<<token);
-                        break;
-                    }
+                    report_append(adc_window_labels[apin][r], results[r]);
                 }
-                tokens.push_back(token);
-                token.clear();
-                ++j;
-            }
-        } else if (msgbuf[i] == '"') {
-            // ditch the quotes but record the status
-            if (in_quotes)
-            {
-                // already in quotes
-                in_quotes = false;
-            } else {
-                in_quotes = true;
             }
-        } else {
-            // normal character, add to buffer
-            token.append(1, msgbuf[i]);
         }
         ++i;
     }
-
-    // preserve any final token
-    if (!token.empty()) {
-        std::transform(token.begin(), token.end(), token.begin(), ::tolower);
-        tokens.push_back(token);
-        token.clear();
-        ++j;
-    }
-
-    // dispatch the tokens
-    // add a dummy extra token to the end of the tokens so that we can always find
-    // an extra empty token to reference when we reach the end
-    tokens.push_back("");
-    i=1;
-    int k = 0;
-    if (bleio) { bleio->write_batch(true); }
-    while (i < j) {
-        DBG("Processing token "<<tokens[i]);
-        k = process_scratch(tokens[i],tokens[i+1]);
-        if (k == 0) {
-            ERR("Failed to parse token "<<i<<" "<<tokens[i]);
-            // failed to parse the command
-            // for a broadcast, skip one token, for sensor-update skip 2
-            if (broadcast) { k = 1; } else { k = 2; }
+    if (with_encoders)
+    {
+        std::vector<encoder_info>::iterator e = encoders.begin();
+        while (e != encoders.end())
+        {
+            if (e->t_ns != 0)
+            {
+                // counts per second between the positions the board sent
+                int32_t speed = 0;
+                if ((e->reported_ns != 0) && (e->t_ns > e->reported_ns))
+                {
+                    speed = ((int64_t)(e->position - e->reported) * 1000000000ll) /
+                            (int64_t)(e->t_ns - e->reported_ns);
+                }
+                report_append_signed(e->label, e->position);
+                report_append_signed(e->speed_label, speed);
+                e->reported = e->position;
+                e->reported_ns = e->t_ns;
+            }
+            ++e;
         }
-        DBG("Consuming "<<k<<" tokens");
-        i+=k;
     }
-    if (bleio) { bleio->write_batch(false); }
-
-    free(msgbuf);
-}
-
-//////////////////////////////////////////////////////////////////////
-//
-// Sending data to scratch
-
-// msg format is
-// XXXX:msgtype "label" [value]
-void write_to_scratch(const std::ostringstream & msg)
-{
-    DBG("writing: "<<msg.str());
-    unsigned int len = msg.str().size();
-    std::string msgbuf;
-    msgbuf.append(1, (char)(len>>24));
-    msgbuf.append(1, (char)((len >> 16) & 0xff));
-    msgbuf.append(1, (char)((len >> 8) & 0xff));
-    msgbuf.append(1, (char)(len & 0xff));
-    msgbuf.append(msg.str());
-
-    if (write(scratch_fd, msgbuf.c_str(), msgbuf.size()) != msgbuf.size())
+    if (ws != nullptr)
     {
-        ERR("Failed to write message to scratch");
-        disconnect_scratch();
+        ws_out.append(1, '}');
+        ws->send(ws_out);
     }
-}
-
-void write_scratch_message(const std::string &msgtype, const std::string &label, const std::string &value)
-{
-    std::ostringstream msg;
-    msg << msgtype;
-    msg << " \"";
-    msg << label;
-    msg << "\"";
-    if (msgtype == "sensor-update") {
-        msg << " \"";
-        msg << value;
-        msg << "\"";
+    if (scratch_fd >= 0)
+    {
+        scratch_msg_end(scratch_out);
+        write_to_scratch();
     }
-    write_to_scratch(msg);
 }
 
-void write_scratch_message(const std::string &msgtype, const std::string &label, int pin, uint32_t value)
+// send every reported pin now
+void write_scratch()
 {
-    std::ostringstream msg;
-    msg << msgtype;
-    msg << " ";
-    if (label.find(' ')) { msg << "\""; }
-    msg << label;
-    msg << pin;
-    if (label.find(' ')) { msg << "\""; }
-    if (msgtype == "sensor-update") {
-        msg << " ";
-        msg << value;
+    report_list.clear();
+    for (size_t i = 0; i < reports.size(); ++i)
+    {
+        report_list.push_back(i);
     }
-    write_to_scratch(msg);
+    write_reports(report_list, !encoders.empty());
 }
 
-// send all interesting pin states to scratch
-void write_scratch()
+// send the reported pins which are due
+void write_scratch_due()
 {
-    for (int i = 0; i<numPins; ++i)
+    uint64_t now = monotonic_ns();
+    report_fired.clear();
+    report_wheel.expire(now, report_fired);
+    report_list.clear();
+    bool with_encoders = false;
+    std::vector<uint32_t>::const_iterator i = report_fired.begin();
+    while (i != report_fired.end())
     {
-        //DBG("Checking pin "<<i);
-        if (myPins[i] == true)
+        if (*i == ENCODER_TIMER)
         {
-            switch (f->getPinMode(i))
+            if ((!encoders.empty()) && (encoder_due_ns <= now))
             {
-                case MODE_ANALOG:
-                    write_scratch_message("sensor-update", "adc", f->getPinAnalogChannel(i), f->analogRead(i));
-                    break;
-                case MODE_INPUT:
-                case MODE_PULLUP:
-                    write_scratch_message("sensor-update", "input", i, f->digitalRead(i));
-                    break;
+                encoder_schedule(now);
+                with_encoders = true;
             }
+            ++i;
+            continue;
+        }
+        int16_t slot = report_slot[*i];
+        // no longer reported, or rescheduled since
+        if ((slot != NO_REPORT) && (reports[slot - 1].due_ns <= now))
+        {
+            report_schedule(reports[slot - 1], now);
+            report_list.push_back(slot - 1);
         }
+        ++i;
     }
+    write_reports(report_list, with_encoders);
 }
 
 //////////////////////////////////////////////////////////////////////
 //
 // main loop and arg handling
+//
+// left out with -DNO_MAIN so that microbench can link the rest
+#ifndef NO_MAIN
 
 void usage(const char * progname, const char * msg = nullptr, int ec = 1)
 {
     if (msg != nullptr) std::cout << msg << std::endl;
     std::cout << "Usage: "<<progname<<" [-s serialDev] ";
 #ifndef NO_BLUETOOTH
-    std::cout << "[-b bdaddr] [-B] ";
+    std::cout << "[-b bdaddr] [-B [-n name] [-c cacheFile]] ";
 #endif
-    std::cout << "[-i reportingInterval] [-H scratchHost] [-P scratchPort] [-d] [-h]" << std::endl;
+    std::cout << "[-S] [-i reportingInterval] [-I samplingInterval] [-L linkRate] [-C captureFile[,records]] [-R recordFile] [-r replayFile [-x speed]] [-H scratchHost] [-P scratchPort] [-W websocketPort [-O origin]] [-M muxSocket] [-m shmName] [-U path=port[:baud[:rx:tx]]] [-d] [-h]" << std::endl;
     std::cout << "    -s /dev/ttyS? (use given serial port)" << std::endl;
 #ifndef NO_BLUETOOTH
     std::cout << "    -b bdaddr (use given bluetooth device)" << std::endl;
-    std::cout << "    -B (use first available bluetooth device)" << std::endl;
+    std::cout << "    -B (use last used or first available bluetooth device)" << std::endl;
+    std::cout << "    -n N (with -B only use devices whose name contains N)" << std::endl;
+    std::cout << "    -c F (with -B remember last device in F, default /var/tmp/scratchdaemon-ble.<hostname>)" << std::endl;
 #endif
+    std::cout << "    -S (use a simulated board)" << std::endl;
     std::cout << "    -i N (use given reporting interval in ms, default 100ms)" << std::endl;
-    std::cout << "    -H H (talk to scratch at given host, default localhost)" << std::endl;
+    std::cout << "    -I N (board samples every N ms, default same as reporting interval)" << std::endl;
+    std::cout << "    -L N (send at most N bytes/s to the board, 0 for no limit, default 5760 serial, 2000 Bluetooth)" << std::endl;
+    std::cout << "    -C F[,N] (record every sample to capture file F holding last N samples)" << std::endl;
+    std::cout << "    -R F (record messages from scratch to file F)" << std::endl;
+    std::cout << "    -r F (replay messages recorded in F instead of talking to scratch)" << std::endl;
+    std::cout << "    -x N (replay at N times recorded speed, 0 for as fast as possible, default 1)" << std::endl;
+    std::cout << "    -H H (talk to scratch at given host name or IPv4/IPv6 address, default localhost, or at Unix socket /path or abstract socket @name)" << std::endl;
     std::cout << "    -P P (talk to scratch on given port, default 42001)" << std::endl;
+    std::cout << "    -W P (serve websocket clients on localhost port P instead of talking to scratch)" << std::endl;
+    std::cout << "    -O O (with -W only accept browser pages from origin O, e.g. https://scratch.mit.edu, * for any, may be repeated, default the Scratch 3 sites, -O null for a page opened from a file)" << std::endl;
+    std::cout << "    -M F (let other programs speak Firmata to the board via Unix socket F)" << std::endl;
+    std::cout << "    -m N (publish pin values in shared memory N, e.g. /scratchdaemon, read with snapshotdump)" << std::endl;
+    std::cout << "    -U F=P[:B[:R:T]] (board serial port P, hw0-3 or sw0-3 on rx pin R and tx pin T, at B baud, default 57600, on a pty linked from F, may be repeated)" << std::endl;
     std::cout << "    -d (enable debug messages)" << std::endl;
     std::cout << "    -h show this help" << std::endl;
     std::cout << std::endl;
@@ -1159,9 +4050,19 @@ int main(int argc, char * argv[])
     int c;
     std::string port;
     int conntype = 0;
-    memset(&myPins[0], 0, sizeof(myPins));
+    std::string capturefile;
+    uint32_t capturerecords = 0;
+    std::string recordfile;
+    std::string replayfile;
+    double replayspeed = 1;
+    int ws_port = -1;
+    std::string mux_path;
+    std::string snapshot_path;
+    std::vector<std::string> serial_specs;
+    std::vector<std::string> ws_origins;
+    startup_ns = monotonic_ns();
 
-    while ((c = getopt(argc, argv, "s:b:Bi:H:P:dh")) >= 0)
+    while ((c = getopt(argc, argv, "s:b:Bn:c:Si:I:L:C:R:r:x:H:P:W:O:M:m:U:dh")) >= 0)
     {
         switch (c)
         {
@@ -1177,9 +4078,45 @@ int main(int argc, char * argv[])
             case 'B': // firmata first bluetooth device
                 conntype = 3;
                 break;
+            case 'n': // bluetooth device name filter
+                ble_name_filter = optarg;
+                break;
+            case 'c': // bluetooth device cache
+                ble_cache_file = optarg;
+                break;
 #endif
+            case 'S': // simulated board
+                conntype = 4;
+                break;
             case 'i': // reporting interval
                 samplingInterval = atoi(optarg);
+                if (samplingInterval <= 0)
+                {
+                    usage(argv[0],"Reporting interval must be at least 1 ms");
+                }
+                break;
+            case 'I': // board sampling interval
+                boardInterval = atoi(optarg);
+                break;
+            case 'L': // link rate
+                link_rate = atoi(optarg);
+                break;
+            case 'C': // capture file
+                capturefile = optarg;
+                if (capturefile.find(',') != std::string::npos)
+                {
+                    capturerecords = atoi(capturefile.substr(capturefile.find(',') + 1).c_str());
+                    capturefile.erase(capturefile.find(','));
+                }
+                break;
+            case 'R': // record scratch session
+                recordfile = optarg;
+                break;
+            case 'r': // replay scratch session
+                replayfile = optarg;
+                break;
+            case 'x': // replay speed
+                replayspeed = atof(optarg);
                 break;
             case 'H': // scratch host
                 scratch_host = optarg;
@@ -1187,6 +4124,21 @@ int main(int argc, char * argv[])
             case 'P': // scratch port
                 scratch_port = atoi(optarg);
                 break;
+            case 'W': // websocket port
+                ws_port = atoi(optarg);
+                break;
+            case 'O': // websocket origin
+                ws_origins.push_back(optarg);
+                break;
+            case 'M': // mux socket
+                mux_path = optarg;
+                break;
+            case 'm': // shared memory snapshot
+                snapshot_path = optarg;
+                break;
+            case 'U': // board serial port on a pty
+                serial_specs.push_back(optarg);
+                break;
             case 'd': // enable debug
                 s_debug = 1;
                 break;
@@ -1212,94 +4164,190 @@ int main(int argc, char * argv[])
 
 #ifndef NO_BLUETOOTH
         case 3: // first bluetooth
-            try
+            if (ble_cache_file.empty())
             {
-                DBG("Looking for bluetooth devices");
-                std::vector<firmata::BlePortInfo> ports = firmata::FirmBle::listPorts(3);
-                if (ports.size() == 0)
-                {
-                    usage(argv[0],"Failed to find any Bluetooth devices");
-                }
-                port = ports[0].port;
+                char host[HOST_NAME_MAX + 1] = "";
+                gethostname(host, sizeof(host) - 1);
+                ble_cache_file = std::string("/var/tmp/scratchdaemon-ble.") + host;
             }
-            catch (...)
+            ble_port = ble_read_cache();
+            if (!ble_port.empty())
+            {
+                // go straight to the last device, look for others meanwhile
+                DBG("Trying last Bluetooth device "<<ble_port);
+                ble_start_scan();
+            }
+            else
             {
-                usage(argv[0],"Failed to search for Bluetooth devices, is the adapter present?");
+                try
+                {
+                    std::vector<firmata::BlePortInfo> ports = ble_list_ports();
+                    if (ports.size() == 0)
+                    {
+                        usage(argv[0],"Failed to find any Bluetooth devices");
+                    }
+                    ble_port = ports[0].port;
+                }
+                catch (...)
+                {
+                    usage(argv[0],"Failed to search for Bluetooth devices, is the adapter present?");
+                }
             }
+            port = ble_port;
 
             // fall thru
 
         case 2: // specified bluetooth
             DBG("Using Bluetooth device "<<port);
 #endif
+            break;
+
+        case 4: // simulated
+            DBG("Using simulated board");
+            break;
 
     }
     // set up the scratch address
-    struct hostent *hostinfo;
-
-    scratch_addr.sin_family = AF_INET;
-    scratch_addr.sin_port = htons (scratch_port);
-    hostinfo = gethostbyname (scratch_host.c_str());
-    if (hostinfo == NULL)
+    std::string why = scratch_resolve();
+    if (!why.empty())
     {
-        std::string msg("Unable to resolve scratch host "+scratch_host);
+        std::string msg("Unable to resolve scratch host "+scratch_host+", "+why);
         usage(argv[0],msg.c_str());
     }
-    scratch_addr.sin_addr = *(struct in_addr *) hostinfo->h_addr;
 
-    sleep(3);
+    if ((!capturefile.empty()) && (!capture_open(capturefile, capturerecords)))
+    {
+        usage(argv[0],"Unable to set up capture file");
+    }
+    if ((!snapshot_path.empty()) && (!snapshot_open(snapshot_path)))
+    {
+        usage(argv[0],"Unable to set up shared memory snapshot");
+    }
 
     signal(SIGINT, do_stop);
     signal(SIGTERM, do_stop);
+    // scratch can go away while link-status or reports are on their way,
+    // which write_to_scratch() deals with
+    signal(SIGPIPE, SIG_IGN);
 
-    while (!stopping)
+    if (!replayfile.empty())
+    {
+        int rc = replay_scratch(conntype, port, replayfile, replayspeed);
+        snapshot_close();
+        return rc;
+    }
+    if ((!recordfile.empty()) && (!record_open(recordfile)))
+    {
+        usage(argv[0],"Unable to set up recording");
+    }
+    if (ws_port > 0)
+    {
+        ws = new WsServer(dispatch_ws_message);
+        for (size_t i = 0; i < ws_origins.size(); ++i)
+        {
+            ws->allow_origin(ws_origins[i]);
+        }
+        if (!ws->listen(ws_port))
+        {
+            std::string msg("Unable to listen for websocket clients, ");
+            msg.append(strerror(errno));
+            usage(argv[0],msg.c_str());
+        }
+    }
+
+    if (!mux_path.empty())
     {
-        // presence of scratch gates everything
-        wait_for_scratch();
+        mux = new FirmMux(mux_message);
+        if (!mux->listen(mux_path))
+        {
+            std::string msg("Unable to listen for Firmata clients, ");
+            msg.append(strerror(errno));
+            usage(argv[0],msg.c_str());
+        }
+    }
 
-        while ((!stopping) && (scratch_fd >= 0))
+    if (!serial_specs.empty())
+    {
+        serial_ptys = new SerialPty(serial_to_board);
+        std::vector<std::string>::const_iterator i = serial_specs.begin();
+        while (i != serial_specs.end())
         {
-            if (!connected_to_firmata())
+            std::string why;
+            if (!serial_ptys->add(*i, why))
             {
-                DBG("Connecting to firmata");
-                try
-                {
-                    connect_firmata(conntype, port);
-                }
-                catch (...)
-                {
-                    // if the connect fails then try again
-                    DBG("connect failed");
-                    continue;
-                }
+                std::string msg("Unable to set up serial port "+*i+", "+why);
+                usage(argv[0],msg.c_str());
             }
+            ++i;
+        }
+    }
 
-            int n = do_poll();
+    while (!stopping)
+    {
+        // bring the board up while waiting for scratch
+        board_poll(conntype, port);
+        if (ws == nullptr)
+        {
+            wait_for_scratch();
+        }
+        board_reported = -1;
 
+        while ((!stopping) && ((scratch_fd >= 0) || (ws != nullptr)))
+        {
             // firmata will throw if not connected
             try
             {
-                f->parse();
-                if (n > 0)
+                // scratch is still served while the board is not ready,
+                // what it asks for is kept until the board is
+                bool ready = board_poll(conntype, port);
+
+                fd_set read_set, write_set;
+                int n = do_poll(read_set, write_set);
+
+                if (ready)
+                {
+                    f->parse();
+                    process_samples();
+                    firmlink->pump();
+                }
+                if ((n > 0) && (scratch_fd >= 0) && FD_ISSET(scratch_fd, &write_set) &&
+                    (!scratch_flush()))
+                {
+                    disconnect_scratch();
+                    ERR("Failed to write message to scratch");
+                }
+                if ((n > 0) && (scratch_fd >= 0) && FD_ISSET(scratch_fd, &read_set))
                 {
                     // scratch message arrived
                     read_scratch_message();
-                } else if (n == 0)
+                }
+                if ((n > 0) && (ws != nullptr))
+                {
+                    ws->handle(read_set, write_set);
+                }
+                if ((n > 0) && (mux != nullptr))
+                {
+                    mux->handle(read_set, write_set);
+                }
+                if ((n > 0) && (serial_ptys != nullptr))
+                {
+                    serial_ptys->handle(read_set);
+                }
+                if (n < 0)
                 {
-                    // timeout, send updates
-                    DBG("time to send samples");
-                    write_scratch();
-                } else {
                     DBG("poll error "<<strerror(errno));
                 }
+                if (ready)
+                {
+                    write_scratch_due();
+                }
             }
             catch (...)
             {
                 // caught exception, close firmata
                 ERR("Firmata connection closed");
-                disconnect_firmata();
-                // wait a while and try again
-                sleep(1);
+                board_drop();
+                // try_connect_firmata() backs off if it does not come back
             }
         }
 
@@ -1309,10 +4357,16 @@ int main(int argc, char * argv[])
             ERR("Firmata bridge is shut down");
         }
 
-        // scratch went away or we are stopping
-        disconnect_firmata();
+        // scratch went away or we are stopping, what it wanted goes too
+        board_drop();
+        board_journal.clear();
         disconnect_scratch();
     }
+    board_shutdown();
+    // removes the sockets, the pty links and the shared memory
+    delete mux;
+    delete serial_ptys;
+    snapshot_close();
     // all done
 }
-
+#endif // NO_MAIN
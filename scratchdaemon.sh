@@ -20,9 +20,16 @@ lock=/var/run/scratchdaemon.$(printf "%s_" "${@//[^a-zA-Z0-9._-]/_}")
 exec 9>$lock
 flock -n 9 || { echo "Already locked, exit" ; exit 1 ; }
 
+# restart straight away after a long run, back off if it keeps failing
+delay=0
 while true ; do
     SECONDS=0
     /usr/local/bin/scratchdaemon "$@"
-    [[ $SECONDS -ge 10 ]] || sleep $((10-SECONDS))
+    if [[ $SECONDS -ge 10 ]] ; then
+        delay=0
+    elif [[ $delay -lt 8 ]] ; then
+        delay=$((delay ? delay*2 : 1))
+    fi
+    sleep $delay
     echo "restarting..."
 done
@@ -0,0 +1,114 @@
+/*
+ * Encoding of messages sent to scratch
+ *
+ * msg format is
+ *     XXXX:msgtype "label" [value]
+ * where XXXX is the big endian length of the rest of the message
+ *
+ * Messages are built directly into a caller supplied buffer which is
+ * reused between messages.  The length prefix is reserved up front and
+ * filled in once the message is complete.
+ */
+#ifndef SCRATCHMSG_H
+#define SCRATCHMSG_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+// start a new message of the given type, discarding any previous contents
+inline void scratch_msg_begin(std::string &buf, const char *msgtype)
+{
+    buf.assign(4, '\0');
+    buf.append(msgtype);
+}
+
+// append an unsigned number in decimal
+inline void scratch_msg_append_uint(std::string &buf, uint32_t value)
+{
+    char digits[10];
+    char *p = &digits[10];
+    do
+    {
+        *--p = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    buf.append(p, &digits[10] - p);
+}
+
+// append a signed number in decimal
+inline void scratch_msg_append_int(std::string &buf, int32_t value)
+{
+    if (value < 0)
+    {
+        buf.append(1, '-');
+        scratch_msg_append_uint(buf, -(uint32_t)value);
+    }
+    else
+    {
+        scratch_msg_append_uint(buf, value);
+    }
+}
+
+// append a string as a quoted token
+inline void scratch_msg_append_quoted(std::string &buf, const std::string &s)
+{
+    buf.append(" \"", 2);
+    buf.append(s);
+    buf.append(1, '"');
+}
+
+// append a number as a separate token
+inline void scratch_msg_append_value(std::string &buf, uint32_t value)
+{
+    buf.append(1, ' ');
+    scratch_msg_append_uint(buf, value);
+}
+
+// fill in the length prefix, buf is then ready to send
+inline void scratch_msg_end(std::string &buf)
+{
+    uint32_t len = buf.size() - 4;
+    buf[0] = (char)(len >> 24);
+    buf[1] = (char)((len >> 16) & 0xff);
+    buf[2] = (char)((len >> 8) & 0xff);
+    buf[3] = (char)(len & 0xff);
+}
+
+// sensor labels are interned so that each is formatted and quoted only
+// once, messages then refer to them by id
+typedef struct
+{
+    std::vector<std::string> quoted; // ' "label"' ready to append
+    std::map<std::string,uint16_t> ids;
+} scratch_label_table;
+
+inline uint16_t scratch_label_intern(scratch_label_table &t, const std::string &label)
+{
+    std::map<std::string,uint16_t>::const_iterator i = t.ids.find(label);
+    if (i != t.ids.end())
+    {
+        return i->second;
+    }
+    uint16_t id = t.quoted.size();
+    t.quoted.push_back(" \"" + label + "\"");
+    t.ids[label] = id;
+    return id;
+}
+
+// intern a label made of a prefix and a number, e.g. adc3
+inline uint16_t scratch_label_intern(scratch_label_table &t, const char *prefix, uint32_t n)
+{
+    std::string label(prefix);
+    scratch_msg_append_uint(label, n);
+    return scratch_label_intern(t, label);
+}
+
+// append an interned label
+inline void scratch_msg_append_label(std::string &buf, const scratch_label_table &t, uint16_t id)
+{
+    buf.append(t.quoted[id]);
+}
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * Board serial ports on local pseudo-terminals, see serialpty.h
+ */
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "serialpty.h"
+#include "firmlink.h"
+
+#define SERIAL_START_SYSEX 0xf0
+#define SERIAL_END_SYSEX 0xf7
+#define SERIAL_DEFAULT_BAUD 57600
+
+// hw0-3 or sw0-3
+static std::string port_name(uint8_t port)
+{
+    std::string name((port >= SERIAL_SW_PORT) ? "sw" : "hw");
+    name.append(1, '0' + (port & 0x07));
+    return name;
+}
+
+// a number from s at pos up to the next ':' or the end, false if there
+// is not one
+static bool parse_number(const std::string &s, size_t &pos, unsigned long max, unsigned long &value)
+{
+    const char *start = s.c_str() + pos;
+    char *end;
+    value = strtoul(start, &end, 10);
+    if ((end == start) || (value > max) || ((*end != '\0') && (*end != ':')))
+    {
+        return false;
+    }
+    pos += (end - start);
+    if (*end == ':')
+    {
+        ++pos;
+    }
+    return true;
+}
+
+void serial_write_msg(std::vector<uint8_t> &msg, uint8_t port, const uint8_t *data, size_t size)
+{
+    msg.clear();
+    msg.push_back(SERIAL_START_SYSEX);
+    msg.push_back(SERIAL_MESSAGE);
+    msg.push_back(SERIAL_WRITE | port);
+    for (size_t i = 0; i < size; ++i)
+    {
+        msg.push_back(data[i] & 0x7f);
+        msg.push_back(data[i] >> 7);
+    }
+    msg.push_back(SERIAL_END_SYSEX);
+}
+
+SerialPty::SerialPty(writefunc handler) :
+    m_handler(handler)
+{
+    memset(m_index, -1, sizeof(m_index));
+}
+
+SerialPty::~SerialPty()
+{
+    std::vector<serial_port>::iterator i = m_ports.begin();
+    while (i != m_ports.end())
+    {
+        close(i->master);
+        close(i->slave);
+        unlink(i->link.c_str());
+        ++i;
+    }
+}
+
+bool SerialPty::add(const std::string &spec, std::string &why)
+{
+    serial_port p;
+    p.baud = SERIAL_DEFAULT_BAUD;
+    p.rx = SERIAL_NO_PIN;
+    p.tx = SERIAL_NO_PIN;
+    size_t eq = spec.find('=');
+    if ((eq == 0) || (eq == std::string::npos) || (spec.size() < eq + 4))
+    {
+        why = "expected path=port";
+        return false;
+    }
+    p.link = spec.substr(0, eq);
+    std::string type(spec.substr(eq + 1, 2));
+    size_t pos = eq + 3;
+    unsigned long n;
+    if (((type != "hw") && (type != "sw")) || (!parse_number(spec, pos, 3, n)))
+    {
+        why = "port must be hw0-3 or sw0-3";
+        return false;
+    }
+    p.port = n + ((type == "sw") ? SERIAL_SW_PORT : 0);
+    if (pos < spec.size())
+    {
+        if (!parse_number(spec, pos, 0x1fffff, n) || (n == 0))
+        {
+            why = "bad baud rate";
+            return false;
+        }
+        p.baud = n;
+    }
+    if (pos < spec.size())
+    {
+        unsigned long rx, tx;
+        if ((!parse_number(spec, pos, 127, rx)) || (!parse_number(spec, pos, 127, tx)) ||
+            (pos < spec.size()))
+        {
+            why = "bad rx or tx pin";
+            return false;
+        }
+        p.rx = rx;
+        p.tx = tx;
+    }
+    if ((p.port >= SERIAL_SW_PORT) && (p.rx == SERIAL_NO_PIN))
+    {
+        why = "software serial needs rx and tx pins";
+        return false;
+    }
+    if (m_index[p.port] >= 0)
+    {
+        why = "port given twice";
+        return false;
+    }
+
+    p.master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (p.master < 0)
+    {
+        why = strerror(errno);
+        return false;
+    }
+    const char *name = nullptr;
+    if ((grantpt(p.master) == 0) && (unlockpt(p.master) == 0))
+    {
+        name = ptsname(p.master);
+    }
+    p.slave = (name != nullptr) ? open(name, O_RDWR | O_NOCTTY | O_CLOEXEC) : -1;
+    if (p.slave < 0)
+    {
+        why = strerror(errno);
+        close(p.master);
+        return false;
+    }
+    fcntl(p.master, F_SETFL, fcntl(p.master, F_GETFL) | O_NONBLOCK);
+    fcntl(p.master, F_SETFD, FD_CLOEXEC);
+
+    // bytes pass through untouched, no echo or line editing
+    struct termios t;
+    tcgetattr(p.slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(p.slave, TCSANOW, &t);
+
+    // left behind if the daemon was killed
+    unlink(p.link.c_str());
+    if (symlink(name, p.link.c_str()) < 0)
+    {
+        why = strerror(errno);
+        close(p.master);
+        close(p.slave);
+        return false;
+    }
+    memset(&p.stats, 0, sizeof(p.stats));
+    p.stats.start_ns = monotonic_ns();
+    m_index[p.port] = m_ports.size();
+    m_ports.push_back(p);
+    return true;
+}
+
+void SerialPty::config(std::vector<std::vector<uint8_t> > &msgs) const
+{
+    msgs.clear();
+    std::vector<serial_port>::const_iterator i = m_ports.begin();
+    while (i != m_ports.end())
+    {
+        std::vector<uint8_t> m;
+        m.push_back(SERIAL_START_SYSEX);
+        m.push_back(SERIAL_MESSAGE);
+        m.push_back(SERIAL_CONFIG | i->port);
+        m.push_back(i->baud & 0x7f);
+        m.push_back((i->baud >> 7) & 0x7f);
+        m.push_back((i->baud >> 14) & 0x7f);
+        if (i->rx != SERIAL_NO_PIN)
+        {
+            m.push_back(i->rx);
+            m.push_back(i->tx);
+        }
+        m.push_back(SERIAL_END_SYSEX);
+        msgs.push_back(m);
+
+        m.clear();
+        m.push_back(SERIAL_START_SYSEX);
+        m.push_back(SERIAL_MESSAGE);
+        m.push_back(SERIAL_READ | i->port);
+        m.push_back(SERIAL_READ_CONTINUOUSLY);
+        m.push_back(SERIAL_END_SYSEX);
+        msgs.push_back(m);
+        ++i;
+    }
+}
+
+void SerialPty::pins(std::vector<uint8_t> &list) const
+{
+    list.clear();
+    std::vector<serial_port>::const_iterator i = m_ports.begin();
+    while (i != m_ports.end())
+    {
+        if (i->rx != SERIAL_NO_PIN)
+        {
+            list.push_back(i->rx);
+            list.push_back(i->tx);
+        }
+        ++i;
+    }
+}
+
+int SerialPty::fill_fds(fd_set &read_set, int fd_max, bool reading)
+{
+    if (!reading)
+    {
+        return fd_max;
+    }
+    std::vector<serial_port>::const_iterator i = m_ports.begin();
+    while (i != m_ports.end())
+    {
+        FD_SET(i->master, &read_set);
+        fd_max = std::max(fd_max, i->master);
+        ++i;
+    }
+    return fd_max;
+}
+
+void SerialPty::handle(const fd_set &read_set)
+{
+    std::vector<serial_port>::iterator i = m_ports.begin();
+    while (i != m_ports.end())
+    {
+        if (FD_ISSET(i->master, &read_set))
+        {
+            // nothing to read is not an error, the slave is held open so
+            // the host closing its end never is either
+            ssize_t n = read(i->master, m_buf, sizeof(m_buf));
+            for (ssize_t ofs = 0; ofs < n; ofs += SERIAL_MAX_CHUNK)
+            {
+                size_t size = std::min((size_t)(n - ofs), (size_t)SERIAL_MAX_CHUNK);
+                m_handler(i->port, m_buf + ofs, size);
+                i->stats.to_board += size;
+                ++i->stats.chunks;
+            }
+        }
+        ++i;
+    }
+}
+
+void SerialPty::send(uint8_t port, const std::string &bytes, uint64_t t_ns)
+{
+    if ((port >= SERIAL_PORTS) || (m_index[port] < 0) || bytes.empty())
+    {
+        return;
+    }
+    serial_port &p(m_ports[m_index[port]]);
+    ssize_t n = write(p.master, bytes.data(), bytes.size());
+    if (n < 0)
+    {
+        n = 0;
+    }
+    // like a UART overrun, what does not fit is lost
+    p.stats.dropped += bytes.size() - n;
+    p.stats.from_board += n;
+    ++p.stats.batches;
+    uint64_t delay = monotonic_ns() - t_ns;
+    p.stats.delay_ns += delay;
+    p.stats.max_delay_ns = std::max(p.stats.max_delay_ns, delay);
+}
+
+void SerialPty::report(std::ostream &out)
+{
+    uint64_t now = monotonic_ns();
+    std::vector<serial_port>::iterator i = m_ports.begin();
+    while (i != m_ports.end())
+    {
+        serial_stats &s(i->stats);
+        uint64_t ms = std::max((now - s.start_ns) / 1000000, (uint64_t)1);
+        if ((s.from_board > 0) || (s.to_board > 0) || (s.dropped > 0))
+        {
+            out << "serial: " << port_name(i->port) << " " << s.from_board
+                << " bytes from board in " << s.batches << " batches ("
+                << (s.from_board * 1000 / ms) << " bytes/s), " << s.to_board
+                << " bytes to board in " << s.chunks << " writes ("
+                << (s.to_board * 1000 / ms) << " bytes/s), " << s.dropped
+                << " dropped, delay mean "
+                << ((s.batches > 0) ? (s.delay_ns / s.batches / 1000) : 0)
+                << " us max " << (s.max_delay_ns / 1000) << " us" << std::endl;
+        }
+        memset(&s, 0, sizeof(s));
+        s.start_ns = now;
+        ++i;
+    }
+}
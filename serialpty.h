@@ -0,0 +1,117 @@
+/*
+ * Board serial ports on local pseudo-terminals
+ *
+ * Firmata Serial (sysex 0x60) lets the host use the UARTs on the board,
+ * e.g. for a GPS or a servo bus.  Each board port given to the daemon
+ * is presented as a pty, with a symlink at a fixed path, so that any
+ * program which can open a serial device can talk to what is on the end
+ * of it while scratch uses the rest of the board.
+ *
+ * What the board receives arrives in SERIAL_REPLY messages, which the
+ * link collects per port, and is written to the pty once per parse of
+ * the board's messages.  What the host writes is read from the pty and
+ * handed back to the daemon in pieces no longer than SERIAL_MAX_CHUNK,
+ * the most one SERIAL_WRITE can carry.  While the link to the board is
+ * busy the ptys are not read, so the host's writes wait in the pty
+ * rather than in the daemon.
+ *
+ * Nothing blocks, the owner adds the ptys to its select() sets with
+ * fill_fds() and passes the results back to handle().
+ */
+#ifndef SERIALPTY_H
+#define SERIALPTY_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <functional>
+#include <stdint.h>
+#include <sys/select.h>
+
+// Firmata Serial sysex and its subcommands, or'ed with the port
+#define SERIAL_MESSAGE 0x60
+#define SERIAL_CONFIG 0x10
+#define SERIAL_WRITE 0x20
+#define SERIAL_READ 0x30
+#define SERIAL_REPLY 0x40
+#define SERIAL_CLOSE 0x50
+#define SERIAL_READ_CONTINUOUSLY 0
+
+// ports are HW_SERIAL0-3 (0-3) and SW_SERIAL0-3 (8-11)
+#define SERIAL_PORTS 16
+#define SERIAL_SW_PORT 8
+// data bytes in one SERIAL_WRITE, each is sent as two 7 bit bytes and
+// the whole sysex must fit the board's 64 byte buffer
+#define SERIAL_MAX_CHUNK 30
+// most read from one pty per handle()
+#define SERIAL_MAX_READ (SERIAL_MAX_CHUNK * 8)
+#define SERIAL_NO_PIN 0xff
+
+typedef struct
+{
+    uint64_t from_board; // bytes
+    uint64_t batches; // writes to the pty
+    uint64_t dropped; // bytes the pty had no room for
+    uint64_t to_board; // bytes
+    uint64_t chunks; // SERIAL_WRITE messages
+    uint64_t delay_ns; // arrival from the board to the pty, total per batch
+    uint64_t max_delay_ns;
+    uint64_t start_ns; // counting since
+} serial_stats;
+
+class SerialPty
+{
+public:
+    // given the port and up to SERIAL_MAX_CHUNK bytes the host wrote
+    typedef std::function<void (uint8_t, const uint8_t *, size_t)> writefunc;
+
+    SerialPty(writefunc handler);
+    ~SerialPty();
+
+    // present board port on a new pty linked from path, replacing any
+    // old link, false if that fails
+    // spec is path=port[:baud[:rxPin:txPin]], port hw0-3 or sw0-3
+    bool add(const std::string &spec, std::string &why);
+
+    // the Firmata to set up every port and start it reporting
+    void config(std::vector<std::vector<uint8_t> > &msgs) const;
+    // pins given for software serial ports
+    void pins(std::vector<uint8_t> &list) const;
+
+    // add the fds that need watching, returns the new fd_max
+    // the ptys are only read if reading
+    int fill_fds(fd_set &read_set, int fd_max, bool reading);
+    // read what the host wrote and hand it on in chunks
+    void handle(const fd_set &read_set);
+
+    // write bytes from the board port to its pty, they arrived at t_ns
+    void send(uint8_t port, const std::string &bytes, uint64_t t_ns);
+
+    // print the counts for ports which were used and restart them
+    void report(std::ostream &out);
+
+    bool empty() const { return m_ports.empty(); }
+
+private:
+    typedef struct
+    {
+        uint8_t port;
+        uint32_t baud;
+        uint8_t rx;
+        uint8_t tx;
+        int master;
+        int slave; // held open so the master never sees a hangup
+        std::string link;
+        serial_stats stats;
+    } serial_port;
+
+    writefunc m_handler;
+    std::vector<serial_port> m_ports;
+    int8_t m_index[SERIAL_PORTS]; // board port to m_ports, -1 if none
+    uint8_t m_buf[SERIAL_MAX_READ];
+};
+
+// SERIAL_WRITE for up to SERIAL_MAX_CHUNK bytes
+void serial_write_msg(std::vector<uint8_t> &msg, uint8_t port, const uint8_t *data, size_t size);
+
+#endif
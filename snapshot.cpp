@@ -0,0 +1,67 @@
+/*
+ * Shared memory pin snapshot, see snapshot.h
+ */
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+#include "firmlink.h"
+
+snapshot_data *snapshot = nullptr;
+std::string snapshot_name;
+
+bool snapshot_open(const std::string &name)
+{
+    snapshot_close();
+
+    // readers map it read only
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create shared memory " << name << ", " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (ftruncate(fd, sizeof(snapshot_data)) < 0)
+    {
+        std::cerr << "Failed to size shared memory " << name << ", " << strerror(errno) << std::endl;
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void *p = mmap(nullptr, sizeof(snapshot_data), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        std::cerr << "Failed to map shared memory " << name << ", " << strerror(errno) << std::endl;
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // the segment starts zeroed, so the count is even and nothing has
+    // a value yet
+    snapshot = (snapshot_data *)p;
+    snapshot->magic = SNAPSHOT_MAGIC;
+    snapshot->version = SNAPSHOT_VERSION;
+    snapshot->size = sizeof(snapshot_data);
+    snapshot->start_ns = monotonic_ns();
+    for (int pin = 0; pin < SNAPSHOT_PINS; ++pin)
+    {
+        snapshot->pins[pin].analog = 127;
+    }
+    snapshot_name = name;
+    return true;
+}
+
+void snapshot_close()
+{
+    if (snapshot != nullptr)
+    {
+        munmap(snapshot, sizeof(snapshot_data));
+        shm_unlink(snapshot_name.c_str());
+        snapshot = nullptr;
+    }
+}
@@ -0,0 +1,111 @@
+/*
+ * Shared memory pin snapshot
+ *
+ * The latest value of every pin, the pin modes and the link statistics
+ * are kept in a fixed layout POSIX shared memory segment so that local
+ * programs, such as dashboards and recorders, can follow the board
+ * without a second Scratch connection.
+ *
+ * The segment is guarded by a sequence count which is odd while the
+ * daemon is changing it.  A reader copies what it wants and uses the
+ * copy only if the count was even and unchanged either side of it, see
+ * snapshot_read().  Neither side makes a syscall or takes a lock, and
+ * the daemon only ever makes a few stores per sample.
+ *
+ * Read with snapshotdump.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <string.h>
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC 0x50414e53 // "SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PINS 256
+#define SNAPSHOT_LANES 2 // normal and priority, as LINK_xxx in firmlink.h
+
+// link states, match BOARD_xxx in scratchdaemon.cpp
+#define SNAPSHOT_DISCONNECTED 0
+#define SNAPSHOT_CONNECTING 1
+#define SNAPSHOT_HANDSHAKING 2
+#define SNAPSHOT_READY 3
+
+typedef struct
+{
+    uint8_t mode; // Firmata pin mode
+    uint8_t analog; // analog channel, 127 if none
+    uint16_t reserved;
+    uint32_t value; // latest input state or analog reading
+    uint64_t t_ns; // monotonic time value arrived, 0 if never
+} snapshot_pin;
+
+typedef struct
+{
+    uint64_t sent;
+    uint64_t superseded;
+    uint64_t conflated;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+} snapshot_lane;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; // of this struct
+    uint32_t num_pins; // as reported by the board
+    uint64_t seq; // odd while being changed
+    uint64_t start_ns; // monotonic time the daemon started
+    uint64_t update_ns; // monotonic time of the last change
+    uint32_t link_state; // SNAPSHOT_xxx
+    uint32_t reserved;
+    snapshot_lane lanes[SNAPSHOT_LANES];
+    snapshot_pin pins[SNAPSHOT_PINS];
+} snapshot_data;
+
+// create the segment called name (e.g. "/scratchdaemon"), replacing any
+// old one, returns false on failure
+bool snapshot_open(const std::string &name);
+// unmap and remove the segment
+void snapshot_close();
+
+extern snapshot_data *snapshot;
+
+// bracket every change, must only be called if snapshot_open() succeeded
+inline void snapshot_begin()
+{
+    __atomic_store_n(&snapshot->seq, snapshot->seq + 1, __ATOMIC_RELAXED);
+    // the odd count must be seen before anything that follows
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+inline void snapshot_end(uint64_t now)
+{
+    snapshot->update_ns = now;
+    __atomic_store_n(&snapshot->seq, snapshot->seq + 1, __ATOMIC_RELEASE);
+}
+
+inline void snapshot_value(uint8_t pin, uint32_t value, uint64_t t_ns)
+{
+    snapshot->pins[pin].value = value;
+    snapshot->pins[pin].t_ns = t_ns;
+}
+
+// copy a consistent snapshot from a mapped segment, false if the daemon
+// was changing it and the caller should try again
+inline bool snapshot_read(const snapshot_data *s, snapshot_data &copy)
+{
+    uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+    {
+        return false;
+    }
+    memcpy(&copy, s, sizeof(copy));
+    // the copy must be complete before the count is looked at again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq);
+}
+
+#endif
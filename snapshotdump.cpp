@@ -0,0 +1,136 @@
+/*
+ * Show the pin snapshot published by scratchdaemon -m
+ *
+ * Output columns are pin, mode, analog channel, value and age (ms since
+ * the value arrived), for every pin the board has sent a value for,
+ * followed by the link state and statistics.  With -w the snapshot is
+ * shown again every interval until interrupted.
+ */
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+void usage(const char * progname, const char * msg = nullptr)
+{
+    if (msg != nullptr) std::cerr << msg << std::endl;
+    std::cerr << "Usage: "<<progname<<" [-w intervalMs] shmName" << std::endl;
+    exit(1);
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+void show(const snapshot_data &s)
+{
+    static const char *states[] = { "disconnected", "connecting", "handshaking", "ready" };
+    static const char *lanes[SNAPSHOT_LANES] = { "normal", "priority" };
+    uint64_t now = now_ns();
+
+    std::cout << "pin,mode,analog,value,age_ms" << std::endl;
+    for (int pin = 0; pin < SNAPSHOT_PINS; ++pin)
+    {
+        const snapshot_pin &p(s.pins[pin]);
+        if (p.t_ns == 0)
+        {
+            continue;
+        }
+        std::cout << pin << "," << (int)p.mode << ",";
+        if (p.analog != 127)
+        {
+            std::cout << (int)p.analog;
+        }
+        std::cout << "," << p.value << "," << ((now - p.t_ns) / 1000000) << std::endl;
+    }
+    std::cout << "link " << ((s.link_state <= SNAPSHOT_READY) ? states[s.link_state] : "unknown")
+              << ", " << s.num_pins << " pins" << std::endl;
+    for (int lane = 0; lane < SNAPSHOT_LANES; ++lane)
+    {
+        const snapshot_lane &l(s.lanes[lane]);
+        if (l.sent > 0)
+        {
+            std::cout << "link " << lanes[lane] << " " << l.sent << " sent, "
+                      << l.superseded << " replaced, " << l.conflated
+                      << " overwritten, wait mean " << (l.wait_ns / l.sent / 1000)
+                      << " us max " << (l.max_wait_ns / 1000) << " us" << std::endl;
+        }
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    int c;
+    int interval = 0;
+    while ((c = getopt(argc, argv, "w:h")) >= 0)
+    {
+        switch (c)
+        {
+            case 'w':
+                interval = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+    }
+    const char *name = argv[optind];
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) < 0))
+    {
+        std::cerr << "Failed to open " << name << ", " << strerror(errno) << std::endl;
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(snapshot_data))
+    {
+        usage(argv[0], "Not a snapshot");
+    }
+    void *p = mmap(nullptr, sizeof(snapshot_data), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        std::cerr << "Failed to map " << name << ", " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    const snapshot_data *s = (const snapshot_data *)p;
+    if ((s->magic != SNAPSHOT_MAGIC) ||
+        (s->version != SNAPSHOT_VERSION) ||
+        (s->size != sizeof(snapshot_data)))
+    {
+        usage(argv[0], "Not a snapshot or unsupported version");
+    }
+
+    snapshot_data copy;
+    do
+    {
+        // the daemon only holds it for a few stores, just try again
+        while (!snapshot_read(s, copy))
+        {
+        }
+        show(copy);
+        if (interval > 0)
+        {
+            std::cout << std::endl;
+            usleep(interval * 1000);
+        }
+    } while (interval > 0);
+
+    munmap(p, sizeof(snapshot_data));
+    return 0;
+}
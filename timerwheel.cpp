@@ -0,0 +1,120 @@
+/*
+ * Hierarchical timer wheel, see timerwheel.h
+ */
+#include <algorithm>
+
+#include "timerwheel.h"
+
+TimerWheel::TimerWheel(uint32_t tick_us) :
+    m_tick_ns(tick_us * 1000ull),
+    m_tick(0),
+    m_count(0)
+{
+}
+
+void TimerWheel::reset(uint64_t now_ns)
+{
+    for (int i = 0; i < TW_INNER_SLOTS; ++i)
+    {
+        m_inner[i].clear();
+    }
+    for (int i = 0; i < TW_OUTER_SLOTS; ++i)
+    {
+        m_outer[i].clear();
+    }
+    m_count = 0;
+    m_tick = now_ns / m_tick_ns;
+}
+
+void TimerWheel::add(uint32_t id, uint64_t due_ns)
+{
+    tw_timer t;
+    t.id = id;
+    // round up, a timer never fires early
+    t.tick = std::max((due_ns + m_tick_ns - 1) / m_tick_ns, m_tick + 1);
+    place(t);
+    ++m_count;
+}
+
+// inner slots are visited one tick at a time, so anything due before
+// the inner wheel has come all the way round can go straight in
+void TimerWheel::place(const tw_timer &t)
+{
+    if ((t.tick - m_tick) < TW_INNER_SLOTS)
+    {
+        m_inner[t.tick & (TW_INNER_SLOTS - 1)].push_back(t);
+    }
+    else
+    {
+        m_outer[(t.tick >> TW_INNER_BITS) % TW_OUTER_SLOTS].push_back(t);
+    }
+}
+
+// the inner wheel is starting round again, bring in the timers due
+// during this turn
+void TimerWheel::cascade()
+{
+    std::vector<tw_timer> &slot(m_outer[(m_tick >> TW_INNER_BITS) % TW_OUTER_SLOTS]);
+    size_t keep = 0;
+    for (size_t i = 0; i < slot.size(); ++i)
+    {
+        if ((slot[i].tick - m_tick) < TW_INNER_SLOTS)
+        {
+            m_inner[slot[i].tick & (TW_INNER_SLOTS - 1)].push_back(slot[i]);
+        }
+        else
+        {
+            // a whole turn of the outer wheel or more away
+            slot[keep++] = slot[i];
+        }
+    }
+    slot.resize(keep);
+}
+
+void TimerWheel::expire(uint64_t now_ns, std::vector<uint32_t> &due)
+{
+    uint64_t now = now_ns / m_tick_ns;
+    while ((m_tick < now) && (m_count > 0))
+    {
+        ++m_tick;
+        if ((m_tick & (TW_INNER_SLOTS - 1)) == 0)
+        {
+            cascade();
+        }
+        std::vector<tw_timer> &slot(m_inner[m_tick & (TW_INNER_SLOTS - 1)]);
+        for (size_t i = 0; i < slot.size(); ++i)
+        {
+            due.push_back(slot[i].id);
+        }
+        m_count -= slot.size();
+        slot.clear();
+    }
+    if (m_count == 0)
+    {
+        // nothing to step through
+        m_tick = std::max(m_tick, now);
+    }
+}
+
+uint64_t TimerWheel::next_due_ns() const
+{
+    if (m_count == 0)
+    {
+        return TW_NONE;
+    }
+    // the inner wheel holds everything due before the next cascade
+    uint64_t tick = m_tick + 1;
+    for (int i = 0; i < TW_INNER_SLOTS; ++i, ++tick)
+    {
+        if ((tick & (TW_INNER_SLOTS - 1)) == 0)
+        {
+            // anything later may still be in the outer wheel
+            return tick * m_tick_ns;
+        }
+        if (!m_inner[tick & (TW_INNER_SLOTS - 1)].empty())
+        {
+            return tick * m_tick_ns;
+        }
+    }
+    return tick * m_tick_ns;
+}
@@ -0,0 +1,62 @@
+/*
+ * Hierarchical timer wheel
+ *
+ * Timers are kept in slots by the tick they are due on.  The inner wheel
+ * has a slot for each of the next TW_INNER_SLOTS ticks, the outer wheel
+ * a slot for each TW_INNER_SLOTS ticks after that, and an outer slot is
+ * spread into the inner wheel as the inner wheel comes round to it.
+ * Adding a timer and collecting those that are due take the same time
+ * however many timers there are.
+ *
+ * Timers are identified by a number chosen by the owner and cannot be
+ * cancelled, the owner ignores any it no longer wants when they fire.
+ */
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TW_INNER_BITS 8
+#define TW_INNER_SLOTS (1 << TW_INNER_BITS)
+#define TW_OUTER_SLOTS 64
+#define TW_NONE UINT64_MAX
+
+class TimerWheel
+{
+public:
+    TimerWheel(uint32_t tick_us);
+
+    // forget every timer and start counting ticks from now
+    void reset(uint64_t now_ns);
+
+    // id fires once due_ns has passed, no sooner than the next tick
+    void add(uint32_t id, uint64_t due_ns);
+
+    // append the ids of the timers due by now_ns to due
+    void expire(uint64_t now_ns, std::vector<uint32_t> &due);
+
+    // when the next timer is due, TW_NONE if there are none
+    uint64_t next_due_ns() const;
+
+    size_t size() const { return m_count; }
+
+private:
+    typedef struct
+    {
+        uint32_t id;
+        uint64_t tick;
+    } tw_timer;
+
+    void place(const tw_timer &t);
+    void cascade();
+
+    uint64_t m_tick_ns;
+    uint64_t m_tick; // every timer up to this tick has fired
+    size_t m_count;
+    std::vector<tw_timer> m_inner[TW_INNER_SLOTS];
+    std::vector<tw_timer> m_outer[TW_OUTER_SLOTS];
+};
+
+#endif
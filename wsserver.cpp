@@ -0,0 +1,566 @@
+/*
+ * WebSocket server, see wsserver.h
+ */
+#include <algorithm>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "wsserver.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xa
+
+//////////////////////////////////////////////////////////////////////////
+//
+// handshake helpers, only ever used on the 60 byte key so kept simple
+
+static uint32_t rol(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1(const std::string &msg, unsigned char digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+    std::string data(msg);
+    uint64_t bits = (uint64_t)msg.size() * 8;
+    data.push_back((char)0x80);
+    while ((data.size() % 64) != 56)
+    {
+        data.push_back(0);
+    }
+    for (int i = 7; i >= 0; --i)
+    {
+        data.push_back((char)(bits >> (i * 8)));
+    }
+
+    for (size_t chunk = 0; chunk < data.size(); chunk += 64)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i)
+        {
+            const unsigned char *p = (const unsigned char *)&data[chunk + (i * 4)];
+            w[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
+        for (int i = 16; i < 80; ++i)
+        {
+            w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i)
+        {
+            uint32_t f, k;
+            if (i < 20)
+            {
+                f = (b & c) | ((~b) & d);
+                k = 0x5a827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 5; ++i)
+    {
+        digest[i*4] = h[i] >> 24;
+        digest[(i*4)+1] = h[i] >> 16;
+        digest[(i*4)+2] = h[i] >> 8;
+        digest[(i*4)+3] = h[i];
+    }
+}
+
+static std::string base64(const unsigned char *data, size_t len)
+{
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = data[i] << 16;
+        if (i + 1 < len) v |= data[i+1] << 8;
+        if (i + 2 < len) v |= data[i+2];
+        out.push_back(table[(v >> 18) & 0x3f]);
+        out.push_back(table[(v >> 12) & 0x3f]);
+        out.push_back((i + 1 < len) ? table[(v >> 6) & 0x3f] : '=');
+        out.push_back((i + 2 < len) ? table[v & 0x3f] : '=');
+    }
+    return out;
+}
+
+// value of the named header, empty if absent
+static std::string header_value(const std::string &request, const char *name)
+{
+    size_t namelen = strlen(name);
+    size_t pos = request.find("\r\n");
+    while ((pos != std::string::npos) && (pos + 2 < request.size()))
+    {
+        pos += 2;
+        if ((strncasecmp(request.c_str() + pos, name, namelen) == 0) &&
+            (request[pos + namelen] == ':'))
+        {
+            size_t start = request.find_first_not_of(" \t", pos + namelen + 1);
+            size_t end = request.find("\r\n", pos);
+            if ((start == std::string::npos) || (start >= end))
+            {
+                return "";
+            }
+            end = request.find_last_not_of(" \t", end - 1);
+            return request.substr(start, end - start + 1);
+        }
+        pos = request.find("\r\n", pos);
+    }
+    return "";
+}
+
+// origins allowed unless told otherwise: the Scratch 3 site, the
+// scratch-gui development server, and pages opened from local files by
+// browsers which say so.  Most browsers send "null" for a local file,
+// but so does any page in a sandboxed iframe or a data: URL, so that
+// has to be allowed with -O null
+static const char * const default_origins[] =
+{
+    "https://scratch.mit.edu",
+    "http://localhost:8601",
+    "file://",
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+WsServer::WsServer(msgfunc handler) :
+    m_handler(handler),
+    m_listen_fd(-1),
+    m_origins(default_origins, default_origins + (sizeof(default_origins) / sizeof(default_origins[0]))),
+    m_default_origins(true)
+{
+}
+
+WsServer::~WsServer()
+{
+    std::vector<ws_client>::iterator i = m_clients.begin();
+    while (i != m_clients.end())
+    {
+        close(i->fd);
+        ++i;
+    }
+    if (m_listen_fd >= 0)
+    {
+        close(m_listen_fd);
+    }
+}
+
+bool WsServer::listen(int port)
+{
+    m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0)
+    {
+        return false;
+    }
+    int on = 1;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if ((bind(m_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (::listen(m_listen_fd, 4) < 0))
+    {
+        int e = errno;
+        close(m_listen_fd);
+        m_listen_fd = -1;
+        errno = e;
+        return false;
+    }
+    return true;
+}
+
+int WsServer::fill_fds(fd_set &read_set, fd_set &write_set, int fd_max)
+{
+    if (m_listen_fd >= 0)
+    {
+        FD_SET(m_listen_fd, &read_set);
+        fd_max = std::max(fd_max, m_listen_fd);
+    }
+    std::vector<ws_client>::const_iterator i = m_clients.begin();
+    while (i != m_clients.end())
+    {
+        FD_SET(i->fd, &read_set);
+        if (!i->out.empty())
+        {
+            FD_SET(i->fd, &write_set);
+        }
+        fd_max = std::max(fd_max, i->fd);
+        ++i;
+    }
+    return fd_max;
+}
+
+void WsServer::handle(const fd_set &read_set, const fd_set &write_set)
+{
+    // clients can be added by accept and by nothing else, so go through
+    // the existing ones by index first
+    size_t i = 0;
+    while (i < m_clients.size())
+    {
+        bool ok = true;
+        if (FD_ISSET(m_clients[i].fd, &read_set))
+        {
+            ok = read_client(m_clients[i]);
+        }
+        if (ok && (!m_clients[i].out.empty()) && FD_ISSET(m_clients[i].fd, &write_set))
+        {
+            ok = flush(m_clients[i]);
+        }
+        if (ok && m_clients[i].closing && m_clients[i].out.empty())
+        {
+            ok = false;
+        }
+        if (!ok)
+        {
+            close(m_clients[i].fd);
+            m_clients.erase(m_clients.begin() + i);
+            continue;
+        }
+        ++i;
+    }
+
+    if ((m_listen_fd >= 0) && FD_ISSET(m_listen_fd, &read_set))
+    {
+        accept_client();
+    }
+}
+
+// may be called from the message handler, so clients which fail are
+// only marked here and removed by handle()
+void WsServer::send(const std::string &text)
+{
+    std::vector<ws_client>::iterator i = m_clients.begin();
+    while (i != m_clients.end())
+    {
+        if (i->open && !i->closing)
+        {
+            queue_frame(*i, WS_OP_TEXT, text.data(), text.size());
+            if (!flush(*i))
+            {
+                i->out.clear();
+                i->closing = true;
+            }
+        }
+        ++i;
+    }
+}
+
+size_t WsServer::clients() const
+{
+    size_t n = 0;
+    std::vector<ws_client>::const_iterator i = m_clients.begin();
+    while (i != m_clients.end())
+    {
+        if (i->open)
+        {
+            ++n;
+        }
+        ++i;
+    }
+    return n;
+}
+
+void WsServer::accept_client()
+{
+    int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    // frames are small and latency matters more than packet count
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    ws_client c;
+    c.fd = fd;
+    c.open = false;
+    c.closing = false;
+    m_clients.push_back(c);
+}
+
+// returns false if the client should be dropped
+bool WsServer::read_client(ws_client &c)
+{
+    char buf[4096];
+    ssize_t n = read(c.fd, buf, sizeof(buf));
+    if (n == 0)
+    {
+        return false;
+    }
+    if (n < 0)
+    {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR));
+    }
+    if (c.closing)
+    {
+        return true;
+    }
+    c.in.append(buf, n);
+    if (!c.open)
+    {
+        return handshake(c);
+    }
+    return parse_frames(c);
+}
+
+void WsServer::allow_origin(const std::string &origin)
+{
+    if (m_default_origins)
+    {
+        m_origins.clear();
+        m_default_origins = false;
+    }
+    m_origins.push_back(origin);
+}
+
+bool WsServer::origin_allowed(const std::string &origin) const
+{
+    std::vector<std::string>::const_iterator i;
+    for (i = m_origins.begin(); i != m_origins.end(); ++i)
+    {
+        // a browser never sends a path, and scheme and host are case
+        // insensitive, so comparing the whole string that way is enough
+        if ((*i == "*") || (strcasecmp(i->c_str(), origin.c_str()) == 0))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool WsServer::handshake(ws_client &c)
+{
+    size_t end = c.in.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        // keep waiting for the rest, unless it is never going to end
+        return (c.in.size() < 8192);
+    }
+    std::string request(c.in.substr(0, end + 2));
+    c.in.erase(0, end + 4);
+
+    std::string key(header_value(request, "Sec-WebSocket-Key"));
+    if ((request.compare(0, 4, "GET ") != 0) || key.empty())
+    {
+        c.out.append("HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+        c.closing = true;
+        return flush(c);
+    }
+    // a web page from elsewhere must not drive the board just because the
+    // browser it is open in runs on this machine
+    std::string origin(header_value(request, "Origin"));
+    if ((!origin.empty()) && (!origin_allowed(origin)))
+    {
+        c.out.append("HTTP/1.1 403 Forbidden\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+        c.closing = true;
+        return flush(c);
+    }
+
+    unsigned char digest[20];
+    sha1(key + WS_GUID, digest);
+    c.out.append("HTTP/1.1 101 Switching Protocols\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: ");
+    c.out.append(base64(digest, sizeof(digest)));
+    c.out.append("\r\n\r\n");
+    c.open = true;
+    if (!flush(c))
+    {
+        return false;
+    }
+    return parse_frames(c);
+}
+
+bool WsServer::parse_frames(ws_client &c)
+{
+    while (c.in.size() >= 2)
+    {
+        const unsigned char *p = (const unsigned char *)c.in.data();
+        bool fin = (p[0] & 0x80) != 0;
+        unsigned char opcode = p[0] & 0x0f;
+        bool masked = (p[1] & 0x80) != 0;
+        uint64_t len = p[1] & 0x7f;
+        size_t header = 2;
+        if (len == 126)
+        {
+            if (c.in.size() < 4) return true;
+            len = (p[2] << 8) | p[3];
+            header = 4;
+        }
+        else if (len == 127)
+        {
+            if (c.in.size() < 10) return true;
+            len = 0;
+            for (int i = 2; i < 10; ++i)
+            {
+                len = (len << 8) | p[i];
+            }
+            header = 10;
+        }
+        // clients must mask what they send
+        if ((!masked) || (len > WS_MAX_MESSAGE) ||
+            ((c.message.size() + len) > WS_MAX_MESSAGE))
+        {
+            return false;
+        }
+        if (c.in.size() < header + 4 + len)
+        {
+            return true;
+        }
+
+        const unsigned char *mask = p + header;
+        std::string payload(c.in, header + 4, len);
+        for (size_t i = 0; i < len; ++i)
+        {
+            payload[i] ^= mask[i % 4];
+        }
+        c.in.erase(0, header + 4 + len);
+
+        switch (opcode)
+        {
+            case WS_OP_CONTINUATION:
+            case WS_OP_TEXT:
+            case WS_OP_BINARY:
+                c.message.append(payload);
+                if (fin)
+                {
+                    std::string message;
+                    message.swap(c.message);
+                    m_handler(message);
+                }
+                break;
+            case WS_OP_PING:
+                queue_frame(c, WS_OP_PONG, payload.data(), payload.size());
+                break;
+            case WS_OP_PONG:
+                break;
+            case WS_OP_CLOSE:
+            default:
+                queue_frame(c, WS_OP_CLOSE, payload.data(), std::min<size_t>(payload.size(), 2));
+                c.closing = true;
+                return flush(c);
+        }
+    }
+    return flush(c);
+}
+
+// send as much as the socket will take
+bool WsServer::flush(ws_client &c)
+{
+    while (!c.out.empty())
+    {
+        // a client going away must not raise SIGPIPE
+        ssize_t n = ::send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        c.out.erase(0, n);
+    }
+    // a client that stops reading is dropped rather than queued for
+    return (c.out.size() <= WS_MAX_PENDING);
+}
+
+void WsServer::queue_frame(ws_client &c, unsigned char opcode, const char *data, size_t len)
+{
+    c.out.push_back((char)(0x80 | opcode));
+    if (len < 126)
+    {
+        c.out.push_back((char)len);
+    }
+    else if (len < 65536)
+    {
+        c.out.push_back((char)126);
+        c.out.push_back((char)(len >> 8));
+        c.out.push_back((char)len);
+    }
+    else
+    {
+        c.out.push_back((char)127);
+        for (int i = 7; i >= 0; --i)
+        {
+            c.out.push_back((char)((uint64_t)len >> (i * 8)));
+        }
+    }
+    c.out.append(data, len);
+}
+
+void ws_json_append_string(std::string &out, const std::string &s)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    std::string::const_iterator i = s.begin();
+    while (i != s.end())
+    {
+        unsigned char ch = *i++;
+        if ((ch == '"') || (ch == '\\'))
+        {
+            out.push_back('\\');
+            out.push_back(ch);
+        }
+        else if (ch < 0x20)
+        {
+            out.append("\\u00");
+            out.push_back(hex[ch >> 4]);
+            out.push_back(hex[ch & 0xf]);
+        }
+        else
+        {
+            out.push_back(ch);
+        }
+    }
+    out.push_back('"');
+}
@@ -0,0 +1,89 @@
+/*
+ * WebSocket server
+ *
+ * Lets clients which cannot use the Scratch 1.4 remote sensors protocol,
+ * such as a Scratch 3 extension running in a browser, talk to the
+ * daemon.  Every text (or binary) message from a client is handed to the
+ * daemon as if it were a Scratch 1.4 message, e.g.
+ *     broadcast "pin13on"
+ *     sensor-update "motora" 50
+ * and the daemon sends text frames back to every client.
+ *
+ * Browsers let any web page open a connection to localhost, so the
+ * Origin a browser sends with the handshake must be on the allowed list,
+ * by default the Scratch 3 sites.
+ * Clients which send no Origin, i.e. programs rather than web pages, are
+ * accepted.
+ *
+ * Nothing blocks, the owner adds the server's fds to its select() sets
+ * with fill_fds() and passes the results back to handle().
+ */
+#ifndef WSSERVER_H
+#define WSSERVER_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <sys/select.h>
+
+// most a client may have waiting to be sent before it is dropped
+#define WS_MAX_PENDING (1024*1024)
+// largest message accepted from a client
+#define WS_MAX_MESSAGE (64*1024)
+
+class WsServer
+{
+public:
+    typedef std::function<void (const std::string &)> msgfunc;
+
+    WsServer(msgfunc handler);
+    ~WsServer();
+
+    // replace the default allowed origins with the given one, may be
+    // called again to allow more, "*" allows any
+    void allow_origin(const std::string &origin);
+
+    // listen on the loopback interface, false if that fails
+    bool listen(int port);
+
+    // add the fds that need watching, returns the new fd_max
+    int fill_fds(fd_set &read_set, fd_set &write_set, int fd_max);
+    // accept clients, read their messages and send what is pending
+    void handle(const fd_set &read_set, const fd_set &write_set);
+
+    // queue a text frame for every connected client
+    void send(const std::string &text);
+
+    // number of clients past the handshake
+    size_t clients() const;
+
+private:
+    typedef struct
+    {
+        int fd;
+        bool open; // handshake complete
+        bool closing; // drop once out is sent
+        std::string in;
+        std::string out;
+        std::string message; // fragments received so far
+    } ws_client;
+
+    void accept_client();
+    bool read_client(ws_client &c);
+    bool handshake(ws_client &c);
+    bool origin_allowed(const std::string &origin) const;
+    bool parse_frames(ws_client &c);
+    bool flush(ws_client &c);
+    void queue_frame(ws_client &c, unsigned char opcode, const char *data, size_t len);
+
+    msgfunc m_handler;
+    int m_listen_fd;
+    std::vector<ws_client> m_clients;
+    std::vector<std::string> m_origins;
+    bool m_default_origins; // m_origins not yet set by allow_origin()
+};
+
+// append s to out as a JSON string
+void ws_json_append_string(std::string &out, const std::string &s);
+
+#endif